@@ -0,0 +1,142 @@
+/*
+ *  LD_PRELOAD shim for `make check-alloc`: osd_monitors must not allocate
+ *  memory once its monitors run, so any malloc and friends once it sets
+ *  steady_state (every instance has ticked) make the process exit with
+ *  status 3, unless they come from one of the allowed functions below.
+ *
+ *  The allowed functions are found on the stack with backtrace and dladdr,
+ *  which needs osd_monitors linked with -rdynamic, as it is for the plugins.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+
+#define MAX_FRAMES 16
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+
+/* What osd_monitors may still allocate, none of it every tick */
+static const struct {
+	const char *function;
+	const char *reason;
+} allowed[] = {
+	{"proc_attach", "once each time the watched process starts again"},
+	{"source_read", "when a file grows past twice its size at open"},
+	{"x11_color", "once per color, the first time a line shows it"},
+};
+
+#define N_ALLOWED (sizeof(allowed)/sizeof(allowed[0]))
+
+/* NULL when not preloaded into osd_monitors, e.g. into timeout */
+static const volatile int *steady_state;
+static __thread int checking;
+
+static void __attribute__((constructor))
+init(void)
+{
+	void *frames[1];
+
+	steady_state = dlsym(RTLD_DEFAULT, "steady_state");
+	/* the first backtrace loads the unwinder, which allocates */
+	backtrace(frames, 1);
+}
+
+/* Returns the index in allowed of the first allowed function on the
+ * stack, or -1 */
+static int
+allowed_caller(void)
+{
+	void *frames[MAX_FRAMES];
+	Dl_info info;
+	int n, i, j;
+
+	n = backtrace(frames, MAX_FRAMES);
+	for (i = 0; i < n; i++) {
+		if (!dladdr(frames[i], &info) || !info.dli_sname)
+			continue;
+		for (j = 0; j < N_ALLOWED; j++)
+			if (!strcmp(info.dli_sname, allowed[j].function))
+				return j;
+	}
+	return -1;
+}
+
+static void
+check(const char *function, size_t size)
+{
+	char buf[256];
+	int len, i;
+
+	if (!steady_state || !*steady_state || checking)
+		return;
+	checking = 1;
+	if ((i = allowed_caller()) >= 0) {
+		len = snprintf(buf, sizeof(buf), "check_alloc: %s(%zu) in %s, allowed %s\n",
+				function, size, allowed[i].function, allowed[i].reason);
+		write(STDERR_FILENO, buf, len);
+		checking = 0;
+		return;
+	}
+	len = snprintf(buf, sizeof(buf), "check_alloc: %s(%zu) after the first tick\n", function, size);
+	write(STDERR_FILENO, buf, len);
+	_exit(3);
+}
+
+void *
+malloc(size_t size)
+{
+	check("malloc", size);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	check("calloc", n * size);
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	check("realloc", size);
+	return __libc_realloc(p, size);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	check("memalign", size);
+	return __libc_memalign(alignment, size);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	check("aligned_alloc", size);
+	return __libc_memalign(alignment, size);
+}
+
+int
+posix_memalign(void **p, size_t alignment, size_t size)
+{
+	check("posix_memalign", size);
+	return (*p = __libc_memalign(alignment, size)) ? 0 : ENOMEM;
+}
+
+void *
+valloc(size_t size)
+{
+	check("valloc", size);
+	return __libc_valloc(size);
+}
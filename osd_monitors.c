@@ -3,22 +3,30 @@
  */
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+#define warn osd_warn
+#define user_warn osd_user_warn
 
 #define SECTOR_SIZE 512
 #define PAGE_SIZE getpagesize()
 
-#define warn(format, ...) fprintf (stderr, "WARN: " format, __VA_ARGS__)
-#define user_warn(format, ...) fprintf (stderr, "USER_WARN: " format, __VA_ARGS__)
-
 /* How often [ms] wake up and test if visibility has changed or timer has
  * expired ? */
 #define WAKE_INTERVAL 500 
 
-/* Maximum number of level-color pairs */
-#define MAX_LEVEL_COLORS 100 
+/* Where to look for plugins by default. */
+#ifndef PLUGIN_DIR
+#define PLUGIN_DIR "/usr/local/lib/osd_monitors"
+#endif
+
+/* Maximum number of monitor types, built in and from plugins together */
+#define MAX_MONITORS 100
+
+/* Maximum number of monitors in one window (see --multiline) */
+#define MAX_LINES 32
 
-/* internal */
-#define MAX_FORMATTED_NUMBER_SIZE 10
+#define LINE_SIZE 256
 
 /* for getline() */
 #define _GNU_SOURCE
@@ -28,6 +36,9 @@
 #include <stdarg.h>
 #include <string.h>
 #include <xosd.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/shape.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <time.h>
@@ -35,42 +46,29 @@
 #include <signal.h>
 #include <sys/statvfs.h>
 #include <errno.h>
-
-/* Structures ***************************************************************/
-
-struct level_color {
-	float level;
-	char *color;
-};
-
-struct cfg {
-	struct monitor *monitor;
-	const char *device;
-	const char *format;
-	char *font;
-	char *color;
-	char *outline_color;
-	int outline_width;
-	int hoffset;
-	int voffset;
-	xosd_pos vpos;
-	xosd_pos hpos;
-	int shadow;
-	int interval;
-	struct level_color level_colors[MAX_LEVEL_COLORS];
-	int n_level_colors;
-};
-
-struct io_stats {
-	float in;
-	float out;
-};
-
-struct usage_stats {
-	float free;
-	float total;
-};
-#define USED_PERCENTAGE(stats) (100.0 * ((stats).total - (stats).free) / (stats).total)
+#include <pthread.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "osd_monitors.h"
 
 /* Misc. ********************************************************************/
 
@@ -120,12 +118,17 @@ format_number(char *buf, float number)
 	}
 }
 
-/* maxsize includes trailing \0, valid values are > 0 */
-void 
-format_io_stats(char *buf, int maxsize, const char *format, struct io_stats *stats)
+/* Expands format into buf, like printf. For every %X conversion, token is
+ * called with spec set to the flags, width and precision between % and X
+ * ("" if none). If token returns 0, X is copied as is, so %% gives %.
+ * maxsize includes trailing \0, valid values are > 0 */
+void
+format_tokens(char *buf, int maxsize, const char *format, format_token_func token, const void *data)
 {
-	char formatted_number[MAX_FORMATTED_NUMBER_SIZE];
+	char formatted[MAX_FORMATTED_TOKEN_SIZE];
+	char spec[MAX_FORMATTED_TOKEN_SIZE];
 	char *s;
+	int n;
 
 	maxsize--; /* for trailing \0 */
 	for (; *format; format++) {
@@ -137,48 +140,77 @@ format_io_stats(char *buf, int maxsize, const char *format, struct io_stats *sta
 			continue;
 		}
 		format++;
-		switch (*format) {
-			case 'i': format_number(formatted_number, stats->in); break;
-			case 'o': format_number(formatted_number, stats->out); break;
-			case 't': format_number(formatted_number, stats->in + stats->out); break;
-			default: *buf++ = *format; maxsize--; continue;
+		for (n = 0; *format && strchr("-+ #0123456789.", *format); format++)
+			if (n < sizeof(spec) - 1)
+				spec[n++] = *format;
+		spec[n] = '\0';
+		if (!*format)
+			break;
+		if (!token(formatted, sizeof(formatted), spec, *format, data)) {
+			*buf++ = *format;
+			maxsize--;
+			continue;
 		}
-		for (s = formatted_number; *s && --maxsize;)
+		for (s = formatted; *s && maxsize; maxsize--)
 			*buf++ = *s++;
 	}
 	*buf = '\0';
 }
 
-/* maxsize includes trailing \0, valid values are > 0 */
-void 
-format_usage_stats(char *buf, int maxsize, const char *format, struct usage_stats *stats)
+/* Formats value with spec (see format_tokens), or with default_spec if spec
+ * is empty */
+void
+format_float(char *buf, int size, const char *spec, const char *default_spec, float value)
 {
-	char formatted_number[MAX_FORMATTED_NUMBER_SIZE];
-	char *s;
+	char format[MAX_FORMATTED_TOKEN_SIZE + 2];
+
+	snprintf(format, sizeof(format), "%%%sf", *spec ? spec : default_spec);
+	snprintf(buf, size, format, value);
+}
+
+int
+io_stats_token(char *buf, int size, const char *spec, char conversion, const void *_stats)
+{
+	const struct io_stats *stats = _stats;
+
+	switch (conversion) {
+		case 'i': format_number(buf, stats->in); break;
+		case 'o': format_number(buf, stats->out); break;
+		case 't': format_number(buf, stats->in + stats->out); break;
+		default: return 0;
+	}
+	return 1;
+}
+
+int
+usage_stats_token(char *buf, int size, const char *spec, char conversion, const void *_stats)
+{
+	const struct usage_stats *stats = _stats;
 	float used = stats->total - stats->free;
 
-	maxsize--; /* for trailing \0 */
-	for (; *format; format++) {
-		if (!maxsize)
-			break;
-		if (*format != '%') {
-			maxsize--;
-			*buf++ = *format;
-			continue;
-		}
-		format++;
-		switch (*format) {
-			case 'f': format_number(formatted_number, stats->free); break;
-			case 'F': snprintf(formatted_number, sizeof(formatted_number), "%.1f", 100.0 * stats->free/stats->total); break;
-			case 'u': format_number(formatted_number, used); break;
-			case 'U': snprintf(formatted_number, sizeof(formatted_number), "%.1f", 100.0 * used/stats->total); break;
-			case 't': format_number(formatted_number, stats->total); break;
-			default: *buf++ = *format; maxsize--; continue;
-		}
-		for (s = formatted_number; *s && --maxsize;)
-			*buf++ = *s++;
+	switch (conversion) {
+		case 'f': format_number(buf, stats->free); break;
+		case 'F': format_float(buf, size, spec, ".1", 100.0 * stats->free/stats->total); break;
+		case 'u': format_number(buf, used); break;
+		case 'U': format_float(buf, size, spec, ".1", 100.0 * used/stats->total); break;
+		case 't': format_number(buf, stats->total); break;
+		default: return 0;
 	}
-	*buf = '\0';
+	return 1;
+}
+
+/* maxsize includes trailing \0, valid values are > 0 */
+void 
+format_io_stats(char *buf, int maxsize, const char *format, struct io_stats *stats)
+{
+	format_tokens(buf, maxsize, format, io_stats_token, stats);
+}
+
+/* maxsize includes trailing \0, valid values are > 0 */
+void 
+format_usage_stats(char *buf, int maxsize, const char *format, struct usage_stats *stats)
+{
+	format_tokens(buf, maxsize, format, usage_stats_token, stats);
 }
 
 /* From glibc documentation
@@ -216,56 +248,498 @@ speed(float s1, float s2, const struct timeval *t1, const struct timeval *t2)
 	return speed;
 }
 
+/* Arena ********************************************************************/
+
+/* Everything a monitor instance keeps (its state, its stats data, ...) is
+ * carved from a few large chunks, freed all at once with the instance. After
+ * startup the heap is left alone. */
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+struct arena {
+	struct arena_chunk *chunks;
+};
+
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	void *p;
+
+	size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+	if (!chunk || chunk->size - chunk->used < size) {
+		if (!(chunk = calloc(1, sizeof(struct arena_chunk) + MAX(size, ARENA_CHUNK_SIZE)))) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		chunk->size = MAX(size, ARENA_CHUNK_SIZE);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	p = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+char *
+arena_strdup(struct arena *arena, const char *s)
+{
+	return strcpy(arena_alloc(arena, strlen(s) + 1), s);
+}
+
+void
+arena_free(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+}
+
+/* Source cache *************************************************************/
+
+struct source {
+	char *path;
+	int fd;
+	char *buf;
+	size_t size;
+	size_t len;
+	unsigned long tick; /* when buf was last filled */
+	int users; /* of source_try_open */
+	int permanent; /* opened by source_open */
+	uint32_t readers; /* bit i set when instance i reads it, see sources_refresh */
+	int slot; /* in the io_uring registered files and buffers, or -1 */
+	struct source *next;
+};
+
+static struct source *sources = NULL;
+/* Incremented by main loop every tick, sources older than this are stale */
+static unsigned long source_tick = 1;
+/* Bit of the instance ticking, set by the main loop */
+static uint32_t source_reader = 0;
+/* Set by the main loop once every instance has ticked, nothing should be
+ * allocated from then on. Exported for check_alloc.so, see check_alloc.c. */
+int steady_state = 0;
+
+/* The sources every tick needs are read in one io_uring submission, with
+ * their fds and buffers registered so that the kernel does not look them up
+ * on each read. Without io_uring (old kernel, seccomp) source_read just
+ * preads them one by one. */
+#define URING_ENTRIES 256
+#define URING_MAX_SLOTS 1024
+
+static struct {
+	int fd; /* -1 before setup, -2 when io_uring is not available */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	int fixed_buffers; /* else IORING_OP_READ into unregistered buffers */
+	int n_slots;
+	struct source *slots[URING_MAX_SLOTS];
+} uring = {fd: -1};
+
+int
+uring_register(unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(SYS_io_uring_register, uring.fd, opcode, arg, nr_args);
+}
+
+void
+uring_buffer_update(struct source *source)
+{
+	struct iovec iov = {source->buf, source->size};
+	struct io_uring_rsrc_update2 update = {offset: source->slot, data: (uintptr_t)&iov, nr: 1};
+
+	if (uring.fixed_buffers && -1 == uring_register(IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update))) {
+		/* most likely RLIMIT_MEMLOCK, the buffers are pinned */
+		warn("io_uring: registering buffers: %s, using plain reads\n", strerror(errno));
+		uring.fixed_buffers = 0;
+	}
+}
+
+/* Gives the source a registered file and buffer slot, when there is one left */
+void
+uring_source_add(struct source *source)
+{
+	struct io_uring_files_update update;
+	int slot;
+
+	source->slot = -1;
+	if (uring.fd < 0)
+		return;
+	for (slot = 0; slot < uring.n_slots && uring.slots[slot]; slot++);
+	if (slot == uring.n_slots)
+		return;
+	update = (struct io_uring_files_update){offset: slot, fds: (uintptr_t)&source->fd};
+	if (1 != uring_register(IORING_REGISTER_FILES_UPDATE, &update, 1))
+		return;
+	uring.slots[slot] = source;
+	source->slot = slot;
+	uring_buffer_update(source);
+}
+
+void
+uring_source_remove(struct source *source)
+{
+	struct io_uring_files_update update;
+	struct iovec iov = {NULL, 0};
+	struct io_uring_rsrc_update2 buffer_update = {offset: source->slot, data: (uintptr_t)&iov, nr: 1};
+	int fd = -1;
+
+	if (source->slot < 0)
+		return;
+	update = (struct io_uring_files_update){offset: source->slot, fds: (uintptr_t)&fd};
+	uring_register(IORING_REGISTER_FILES_UPDATE, &update, 1);
+	if (uring.fixed_buffers)
+		uring_register(IORING_REGISTER_BUFFERS_UPDATE, &buffer_update, sizeof(buffer_update));
+	uring.slots[source->slot] = NULL;
+}
+
+/* Sets up the ring, registers sparse file and buffer tables and the sources
+ * opened so far. Returns 0 when io_uring can't be used. */
+int
+uring_setup(void)
+{
+	struct io_uring_params params;
+	struct io_uring_rsrc_register buffers = {flags: IORING_RSRC_REGISTER_SPARSE};
+	int fds[URING_MAX_SLOTS];
+	struct rlimit nofile;
+	struct source *source;
+	char *sq, *cq;
+	size_t sq_size, cq_size;
+	int i;
+
+	memset(&params, 0, sizeof(params));
+	uring.fd = -2;
+	if (-1 == (i = syscall(SYS_io_uring_setup, URING_ENTRIES, &params)))
+		return 0;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(i);
+		return 0;
+	}
+	uring.fd = i;
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+	sq = cq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || uring.sqes == MAP_FAILED)
+		goto fail;
+	uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+	uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+	uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+	uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	for (i = 0; i < (int)params.sq_entries; i++)
+		uring.sq_array[i] = i;
+
+	/* registered files count against the open files limit */
+	uring.n_slots = URING_MAX_SLOTS;
+	if (!getrlimit(RLIMIT_NOFILE, &nofile) && nofile.rlim_cur / 2 < (rlim_t)uring.n_slots)
+		uring.n_slots = nofile.rlim_cur / 2;
+	for (i = 0; i < uring.n_slots; i++)
+		fds[i] = -1;
+	if (-1 == uring_register(IORING_REGISTER_FILES, fds, uring.n_slots))
+		goto fail;
+	buffers.nr = uring.n_slots;
+	uring.fixed_buffers = -1 != uring_register(IORING_REGISTER_BUFFERS2, &buffers, sizeof(buffers));
+
+	for (source = sources; source; source = source->next)
+		uring_source_add(source);
+	return 1;
+
+fail:
+	close(uring.fd);
+	uring.fd = -2;
+	return 0;
+}
+
+/* Takes the completions of the submitted reads, the sources they fill are
+ * fresh for this tick. A full buffer is left for source_read to grow. */
+void
+uring_reap(int *pending)
+{
+	unsigned head = *uring.cq_head;
+	struct io_uring_cqe *cqe;
+	struct source *source;
+
+	for (; head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE); head++, (*pending)--) {
+		cqe = &uring.cqes[head & *uring.cq_mask];
+		source = (struct source *)(uintptr_t)cqe->user_data;
+		if (cqe->res < 0 || (size_t)cqe->res == source->size)
+			continue;
+		source->buf[cqe->res] = '\0';
+		source->len = cqe->res;
+		source->tick = source_tick;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Closes the ring for good, which also cancels reads still in flight. The
+ * sources are then read by source_read. */
+void
+uring_disable(void)
+{
+	struct source *source;
+
+	close(uring.fd);
+	uring.fd = -2;
+	for (source = sources; source; source = source->next)
+		source->slot = -1;
+}
+
+/* Submits n queued reads and waits for them, in a single io_uring_enter
+ * unless the kernel takes only some of them or a signal interrupts the wait.
+ * The ones it does not take are dropped from the queue, source_read preads
+ * them. */
+void
+uring_submit(unsigned n)
+{
+	int submitted, pending;
+
+	do
+		submitted = syscall(SYS_io_uring_enter, uring.fd, n, n, IORING_ENTER_GETEVENTS, NULL, 0);
+	while (submitted == -1 && errno == EINTR);
+	if (submitted == -1) {
+		warn("io_uring_enter: %s\n", strerror(errno));
+		submitted = 0;
+	}
+	/* the kernel has taken the first submitted ones, the rest would
+	 * otherwise be submitted stale with the next batch */
+	if ((unsigned)submitted < n)
+		__atomic_store_n(uring.sq_tail, *uring.sq_tail - (n - submitted), __ATOMIC_RELEASE);
+
+	pending = submitted;
+	uring_reap(&pending);
+	while (pending) {
+		if (-1 == syscall(SYS_io_uring_enter, uring.fd, 0, pending, IORING_ENTER_GETEVENTS, NULL, 0) &&
+				errno != EINTR) {
+			warn("io_uring_enter: %s, reading without io_uring\n", strerror(errno));
+			uring_disable();
+			return;
+		}
+		uring_reap(&pending);
+	}
+}
+
+/* Reads the sources the instances in the readers mask read last time, with
+ * as few syscalls as possible. The rest are read by source_read as needed. */
+void
+sources_refresh(uint32_t readers)
+{
+	struct io_uring_sqe *sqe;
+	struct source *source;
+	unsigned tail, n = 0;
+
+	if (uring.fd == -1)
+		uring_setup();
+	if (uring.fd < 0)
+		return;
+
+	tail = *uring.sq_tail;
+	for (source = sources; source; source = source->next) {
+		if (!(source->readers & readers) || source->slot < 0)
+			continue;
+		sqe = &uring.sqes[tail & *uring.sq_mask];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = uring.fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = source->slot;
+		sqe->addr = (uintptr_t)source->buf;
+		sqe->len = source->size;
+		sqe->buf_index = source->slot;
+		sqe->user_data = (uintptr_t)source;
+		__atomic_store_n(uring.sq_tail, ++tail, __ATOMIC_RELEASE);
+		if (++n == URING_ENTRIES) {
+			uring_submit(n);
+			n = 0;
+			/* uring_submit moves the tail back over the entries the
+			 * kernel did not take, the next ones go in their place */
+			tail = *uring.sq_tail;
+		}
+	}
+	if (n)
+		uring_submit(n);
+}
+
+/* Instances change places on a --config reload */
+void
+sources_forget_readers(void)
+{
+	struct source *source;
+
+	for (source = sources; source; source = source->next)
+		source->readers = 0;
+}
+
+struct source *
+source_try_open(const char *path)
+{
+	struct source *source;
+	ssize_t len;
+	int fd;
+
+	for (source = sources; source; source = source->next)
+		if (!strcmp(source->path, path)) {
+			source->users++;
+			return source;
+		}
+
+	if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC)))
+		return NULL;
+	source = calloc(1, sizeof(struct source));
+	source->fd = fd;
+	source->users = 1;
+	source->path = strdup(path);
+	/* with room for the file to double, source_read should not have to
+	 * grow the buffer once the monitors run */
+	source->size = 4096;
+	source->buf = malloc(source->size);
+	while ((len = pread(fd, source->buf, source->size, 0)) > (ssize_t)source->size / 2) {
+		source->size *= 2;
+		source->buf = realloc(source->buf, source->size);
+	}
+	source->next = sources;
+	sources = source;
+	uring_source_add(source);
+	return source;
+}
+
+struct source *
+source_open(const char *path)
+{
+	struct source *source;
+
+	if (!(source = source_try_open(path))) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	source->users--;
+	source->permanent = 1;
+	return source;
+}
+
+void
+source_close(struct source *source)
+{
+	struct source **s;
+
+	if (--source->users || source->permanent)
+		return;
+	for (s = &sources; *s != source; s = &(*s)->next);
+	*s = source->next;
+	uring_source_remove(source);
+	close(source->fd);
+	free(source->path);
+	free(source->buf);
+	free(source);
+}
+
+const char *
+source_read(struct source *source, size_t *len)
+{
+	ssize_t read;
+
+	if (source->tick != source_tick) {
+		/* procfs files are generated on read, the whole file must fit in
+		 * the buffer to get a consistent snapshot */
+		while ((read = pread(source->fd, source->buf, source->size, 0)) == (ssize_t)source->size) {
+			source->size *= 2;
+			source->buf = realloc(source->buf, source->size);
+			if (source->slot >= 0)
+				uring_buffer_update(source);
+		}
+		if (read == -1) {
+			warn("source_read: %s: %s\n", source->path, strerror(errno));
+			read = 0;
+		}
+		source->buf[read] = '\0';
+		source->len = read;
+		source->tick = source_tick;
+	}
+	source->readers |= source_reader;
+	if (len)
+		*len = source->len;
+	return source->buf;
+}
+
+/* File parsing *************************************************************/
+
+/* Finds the next token in [*s, end) delimited by any of delims. Returns the
+ * token start and moves *s past it, or returns NULL when there is no token. */
+const char *
+next_token(const char **s, const char *end, const char *delims)
+{
+	const char *token;
+
+	for (token = *s; token < end && strchr(delims, *token); token++);
+	if (token >= end) {
+		*s = end;
+		return NULL;
+	}
+	for (*s = token; *s < end && !strchr(delims, **s); (*s)++);
+	return token;
+}
+
 /* Reads longs from multiple columns of one line in file.
  * ... is a list of (int colnumber, float *result) pairs, sorted by colnumber
  */
 void
 read_columns_from_file(const char *fname, const char *match_pattern, int n_vals, ...)
 {
-	FILE *f;
-	char *line = NULL;
-	char *line_start;
-	size_t len = 0;
-	char *saveptr = NULL, *token;
-	int i, result_idx;
+	const char *line, *line_end, *end, *token;
+	size_t len;
+	int result_idx;
 	va_list ap;
 	int cur_col, next_col;
 	float *result;
 
 	va_start(ap, n_vals);
 
-	if (NULL == (f = fopen(fname, "r"))) {
-			perror("fopen");
-			exit(EXIT_FAILURE);
-	}
+	line = source_read(source_open(fname), &len);
+	end = line + len;
 	cur_col = 0;
-	while ((getline(&line, &len, f)) != -1) {
-		for (line_start = line; *line_start == ' '; line_start++);
-		if (!strstr(line_start, match_pattern))
+	for (; line < end; line = line_end + 1) {
+		line_end = memchr(line, '\n', end - line);
+		if (!line_end)
+			line_end = end;
+		for (; *line == ' '; line++);
+		if (!memmem(line, line_end - line, match_pattern, strlen(match_pattern)))
 			continue;
-		/* colon in strtok_r is neccessary for parsing /proc/net/dev */
-		token = strtok_r(line_start, " :", &saveptr);
+		/* colon in delimiters is neccessary for parsing /proc/net/dev */
+		token = next_token(&line, line_end, " :");
 		for (result_idx = 0; result_idx < n_vals; result_idx++) {
 			next_col = va_arg(ap, int);
 			result = va_arg(ap, float *);
-			for (i = 0; i < next_col - cur_col; i++)
-				token = strtok_r(NULL, " :", &saveptr);
+			for (; cur_col < next_col && token; cur_col++)
+				token = next_token(&line, line_end, " :");
 			if (!token) {
 				warn("read_columns_from_file: not enough columns in '%s'('%s')\n", 
 						match_pattern, fname);
 				goto end;
 			}
 			*result = atof(token);
-			cur_col = next_col;
 		}
 		goto end;
 	}
 	warn("read_columns_from_file: '%s' line not found in '%s'\n", match_pattern, fname);
 
 end:
-	fclose(f);
-	if (line)
-		free(line);
 	va_end(ap);
 }
 
@@ -276,73 +750,258 @@ end:
 void
 read_lines_from_file(const char *fname, int n_vals, ...)
 {
-	FILE *f;
-	char *line = NULL;
-	size_t len = 0;
-	char *saveptr = NULL, *token;
+	const char *line, *line_end, *end, *token;
+	size_t len;
 	va_list ap;
 	const char *match_pattern;
 	float *result;
-	ssize_t read;
-
 
 	va_start(ap, n_vals);
 
-	if (NULL == (f = fopen(fname, "r"))) {
-			perror("fopen");
-			exit(EXIT_FAILURE);
-	}
+	line = source_read(source_open(fname), &len);
+	end = line + len;
 	while(n_vals--) {
 		match_pattern = va_arg(ap, const char *);
 		result = va_arg(ap, float *);
-		while (-1 != (read = (getline(&line, &len, f)))) {
-			if (strstr(line, match_pattern))
+		for (; line < end; line = line_end + 1) {
+			line_end = memchr(line, '\n', end - line);
+			if (!line_end)
+				line_end = end;
+			if (memmem(line, line_end - line, match_pattern, strlen(match_pattern)))
 				break;
 		}
-		if (-1 == read) {
+		if (line >= end) {
 			warn("read_lines_from_file: Not all lines found in '%s'\n", fname);
 			break;
 		}
-		token = strtok_r(line, " ", &saveptr);
-		token = strtok_r(NULL, " ", &saveptr);
-		*result = atof(token);
+		next_token(&line, line_end, " ");
+		token = next_token(&line, line_end, " ");
+		*result = token ? atof(token) : 0.0;
+		line = line_end + 1;
 	}
 
-	fclose(f);
-	if (line)
-		free(line);
 	va_end(ap);
 }
 
-/* Reads a single line from file specified by contacenating path. Trailing \n is stripped*
- * line and len semantics is the same as at getline(3) */
+/* Files made of header/value line pairs, like /proc/net/snmp:
+ *   Tcp: RtoAlgorithm RtoMin ...
+ *   Tcp: 1 200 ...
+ * Fields are looked up by name once, then read by position. */
+
+/* Finds prefix's name field in text. Not found fields get line -1. */
 void
-read_first_line_from_file(const char *path1, const char *path2, const char *path3, 
-    char **line, size_t *len)
+table_field_resolve(const char *text, const char *prefix, const char *name, struct table_field *field)
 {
-	FILE *f;
-	ssize_t read;
-  char *fname = malloc(strlen(path1) + strlen(path2) + strlen(path3) + 1);
-  strcpy(fname, path1);
-  strcat(fname, path2);
-  strcat(fname, path3);
+	const char *line, *line_end, *end = text + strlen(text), *token;
+	size_t prefix_len = strlen(prefix), name_len = strlen(name);
+	int line_number, column;
+
+	field->line = -1;
+	for (line = text, line_number = 0; line < end; line = line_end + 1, line_number++) {
+		line_end = memchr(line, '\n', end - line);
+		if (!line_end)
+			line_end = end;
+		if (strncmp(line, prefix, prefix_len) || line[prefix_len] != ':')
+			continue;
+		/* the first line of the pair are the names */
+		for (column = 0; (token = next_token(&line, line_end, " ")); column++) {
+			if (line - token == name_len && !strncmp(token, name, name_len)) {
+				field->line = line_number + 1;
+				field->column = column;
+				return;
+			}
+		}
+		line = line_end + 1;
+		line_end = memchr(line, '\n', end - line);
+		if (!line_end)
+			line_end = end;
+		line_number++;
+	}
+}
 
-	if (NULL == (f = fopen(fname, "r"))) {
-			perror("fopen");
-			exit(EXIT_FAILURE);
+/* Reads the values of resolved fields in one pass over text. Fields that were
+ * not found read as 0. */
+void
+table_fields_read(const char *text, const struct table_field *fields, int n_fields, uint64_t *values)
+{
+	const char *line, *line_end, *end = text + strlen(text), *token;
+	int line_number, column, i, last_line = -1;
+
+	for (i = 0; i < n_fields; i++) {
+		values[i] = 0;
+		last_line = MAX(last_line, fields[i].line);
+	}
+	for (line = text, line_number = 0; line < end && line_number <= last_line;
+			line = line_end + 1, line_number++) {
+		line_end = memchr(line, '\n', end - line);
+		if (!line_end)
+			line_end = end;
+		for (i = 0; i < n_fields && fields[i].line != line_number; i++);
+		if (i == n_fields)
+			continue;
+		for (column = 0; (token = next_token(&line, line_end, " ")); column++)
+			for (i = 0; i < n_fields; i++)
+				if (fields[i].line == line_number && fields[i].column == column)
+					values[i] = strtoull(token, NULL, 10);
+	}
+}
+
+/* Wide lines of numbers, like the per cpu columns of /proc/interrupts. With
+ * hundreds of cpus the lines are kilobytes long and mostly blanks, so they
+ * are classified 16 (SSE2) or 32 (AVX2) bytes at a time where the cpu can,
+ * and only the digits themselves are looked at one by one. */
+
+struct number_scan {
+	uint64_t *values;
+	int max;
+	int n;
+	uint64_t value;
+	int in_number;
+	int done;
+};
+
+/* Consumes width (< 64) bytes at p. digits and others are masks of the bytes
+ * that are digits, and that are neither digits nor blanks. */
+static inline void
+number_scan_block(struct number_scan *scan, const char *p, int width, uint64_t digits, uint64_t others)
+{
+	int pos = 0, limit = width, run;
+	uint64_t rest;
+
+	if (others) {
+		limit = __builtin_ctzll(others);
+		scan->done = 1;
+	}
+	while (pos < limit && scan->n < scan->max) {
+		if (!scan->in_number) {
+			rest = (digits >> pos) & ((1ULL << (limit - pos)) - 1);
+			if (!rest)
+				break;
+			pos += __builtin_ctzll(rest);
+			scan->in_number = 1;
+			scan->value = 0;
+		}
+		run = MIN(__builtin_ctzll(~(digits >> pos)), limit - pos);
+		for (; run; run--, pos++)
+			scan->value = scan->value * 10 + (p[pos] - '0');
+		if (pos < limit) {
+			scan->values[scan->n++] = scan->value;
+			scan->in_number = 0;
+		}
+	}
+	/* a number running into something else, like "2-edge", is not one */
+	if (scan->done)
+		scan->in_number = 0;
+	if (scan->n == scan->max)
+		scan->done = 1;
+}
+
+static inline void
+number_scan_tail(struct number_scan *scan, const char *p, const char *end)
+{
+	uint64_t digits = 0, others = 0;
+	int i;
+
+	for (i = 0; p + i < end; i++) {
+		if (p[i] >= '0' && p[i] <= '9')
+			digits |= 1ULL << i;
+		else if (p[i] != ' ' && p[i] != '\t')
+			others |= 1ULL << i;
+	}
+	number_scan_block(scan, p, i, digits, others);
+}
+
+static inline int
+number_scan_finish(struct number_scan *scan)
+{
+	if (!scan->done && scan->in_number)
+		scan->values[scan->n++] = scan->value;
+	return scan->n;
+}
+
+#define NUMBER_SCAN_SCALAR_BLOCK 48
+
+int
+scan_numbers_scalar(const char *p, const char *end, uint64_t *values, int max)
+{
+	struct number_scan scan = {values, max};
+
+	for (; !scan.done && p < end; p += NUMBER_SCAN_SCALAR_BLOCK)
+		number_scan_tail(&scan, p, MIN(end, p + NUMBER_SCAN_SCALAR_BLOCK));
+	return number_scan_finish(&scan);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+int
+scan_numbers_sse2(const char *p, const char *end, uint64_t *values, int max)
+{
+	struct number_scan scan = {values, max};
+	const __m128i below_zero = _mm_set1_epi8('0' - 1), above_nine = _mm_set1_epi8('9' + 1);
+	const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+	__m128i block;
+	uint64_t digits, blanks;
+
+	for (; !scan.done && end - p >= 16; p += 16) {
+		block = _mm_loadu_si128((const __m128i *)p);
+		digits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(block, below_zero),
+					_mm_cmplt_epi8(block, above_nine)));
+		blanks = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, space),
+					_mm_cmpeq_epi8(block, tab)));
+		if (blanks == 0xffff && !scan.in_number)
+			continue;
+		number_scan_block(&scan, p, 16, digits, ~(digits | blanks) & 0xffff);
 	}
+	if (!scan.done)
+		number_scan_tail(&scan, p, end);
+	return number_scan_finish(&scan);
+}
 
-	read = getline(line, len, f);
-  if (-1 == read) {
-    warn("read_first_line_from_file: getline failed (%s)", fname);
-  } else {
-    if ((*line)[read-1] == '\n') {
-      (*line)[read-1] = '\0';
-    }
-  }
+__attribute__((target("avx2")))
+int
+scan_numbers_avx2(const char *p, const char *end, uint64_t *values, int max)
+{
+	struct number_scan scan = {values, max};
+	const __m256i below_zero = _mm256_set1_epi8('0' - 1), above_nine = _mm256_set1_epi8('9' + 1);
+	const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+	__m256i block;
+	uint64_t digits, blanks;
+
+	for (; !scan.done && end - p >= 32; p += 32) {
+		block = _mm256_loadu_si256((const __m256i *)p);
+		digits = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpgt_epi8(block, below_zero),
+					_mm256_cmpgt_epi8(above_nine, block)));
+		blanks = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, space),
+					_mm256_cmpeq_epi8(block, tab)));
+		if (blanks == 0xffffffff && !scan.in_number)
+			continue;
+		number_scan_block(&scan, p, 32, digits, ~(digits | blanks) & 0xffffffff);
+	}
+	if (!scan.done)
+		number_scan_tail(&scan, p, end);
+	return number_scan_finish(&scan);
+}
+#endif
 
-	fclose(f);
-  free(fname);
+/* Reads up to max blank separated unsigned numbers from the start of
+ * [p, end), which is one line without the '\n'. Stops at anything else.
+ * Returns how many numbers were read. */
+int
+scan_numbers(const char *p, const char *end, uint64_t *values, int max)
+{
+	static int (*scan)(const char *p, const char *end, uint64_t *values, int max);
+
+	if (!scan) {
+		scan = scan_numbers_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			scan = scan_numbers_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+			scan = scan_numbers_sse2;
+#endif
+	}
+	return scan(p, end, values, max);
 }
 
 /* Signal handling **********************************************************/
@@ -389,244 +1048,2328 @@ setup_signal_handlers(void)
 	}
 }
 
-/* Monitors *****************************************************************/
+/* Output *******************************************************************/
 
-/* shared */
+/* All monitors of the process share one window, each has its own line in it.
+ * Lines are redrawn only when they change. The window itself is drawn by one
+ * of the backends below. */
 
-struct monitor {
-	const char *name;
-	const char *description;
-	const char *default_device;
-	const char *default_format;
-
-	void *(*create_stats_data)(const struct cfg *cfg);
-	void (*retrieve_stats)(void *stats, const struct cfg *cfg);
-	void (*render)(xosd *osd, const struct cfg *cfg,
-			const struct timeval *t_now, const struct timeval *t_before,
-			const void *stats_now, const void *stats_before); 
+struct line {
+	int number; /* line number in the window, from 1 */
+	const struct cfg *cfg;
+	char text[LINE_SIZE];
+	const char *color; /* NULL when the line is blank */
+};
+
+struct backend {
+	const char *name;
+	void (*create)(const struct cfg *cfg, int n_lines);
+	/* line->text or line->color has changed */
+	void (*update_line)(const struct line *line, int text_changed);
+	/* called every wake up, e.g. to handle events */
+	void (*poll)(void);
+	/* closes the window, create may be called again */
+	void (*destroy)(void);
+};
+
+static struct window {
+	const struct backend *backend;
+	struct line lines[MAX_LINES];
+	int n_lines;
+} window;
+
+/* xosd backend */
+
+/* Long enough for any X color name */
+#define COLOR_NAME_SIZE 64
+
+static struct {
+	xosd *osd;
+	char color[COLOR_NAME_SIZE];
+} xosd_window;
+
+/* The first xosd line is left empty, lines are numbered from 1 */
+void
+xosd_backend_create(const struct cfg *cfg, int n_lines)
+{
+	xosd *osd;
+
+	if (!(osd = xosd_create (n_lines + 1))) {
+		fprintf (stderr, "Error initializing osd\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cfg->font != NULL && strlen(cfg->font) > 0) 
+		xosd_set_font (osd, cfg->font);
+	xosd_set_colour (osd, cfg->color);
+	xosd_set_shadow_offset (osd, cfg->shadow);
+	xosd_set_pos (osd, cfg->vpos);
+	xosd_set_align (osd, cfg->hpos);
+	xosd_set_vertical_offset(osd, cfg->voffset);
+	xosd_set_horizontal_offset(osd, cfg->hoffset);
+	xosd_set_outline_offset(osd, cfg->outline_width);
+	xosd_set_outline_colour(osd, cfg->outline_color);
+
+	xosd_window.osd = osd;
+	snprintf(xosd_window.color, COLOR_NAME_SIZE, "%s", cfg->color);
+}
+
+/* libxosd draws the whole window in one color. With more lines, the window
+ * takes the color of the line that is highest up its --level-colors scale. */
+void
+xosd_backend_update_color(void)
+{
+	const struct line *line;
+	const char *color = NULL;
+	int i, j, rank, best_rank = -2;
+
+	for (i = 0; i < window.n_lines; i++) {
+		line = window.lines + i;
+		if (!line->color)
+			continue;
+		rank = -1;
+		for (j = 0; j < line->cfg->n_level_colors; j++)
+			if (line->cfg->level_colors[j].color == line->color)
+				rank = j;
+		if (rank > best_rank) {
+			best_rank = rank;
+			color = line->color;
+		}
+	}
+	if (color && strcmp(color, xosd_window.color)) {
+		xosd_set_colour(xosd_window.osd, color);
+		snprintf(xosd_window.color, COLOR_NAME_SIZE, "%s", color);
+	}
+}
+
+void
+xosd_backend_destroy(void)
+{
+	xosd_destroy(xosd_window.osd);
+	xosd_window.osd = NULL;
+}
+
+void
+xosd_backend_update_line(const struct line *line, int text_changed)
+{
+	xosd_backend_update_color();
+	if (text_changed)
+		xosd_display(xosd_window.osd, line->number, XOSD_string, line->text);
+}
+
+/* x11 backend */
+
+/* A shaped override-redirect window like the libxosd one, drawn with core X
+ * fonts the same way. libxosd redraws and reshapes the whole window on every
+ * change. Here the masks of every glyph are rendered once and cached, and
+ * only the glyphs that differ from what is on the screen (character,
+ * position or color) are erased from the shape and drawn again. */
+
+struct x11_glyph {
+	Pixmap text; /* 1 bit masks, None until the glyph is first used */
+	Pixmap outline;
+};
+
+/* A glyph as it is on the screen */
+struct x11_cell {
+	unsigned char c;
+	short x;
+	unsigned long pixel;
+};
+
+static struct {
+	Display *dpy;
+	Window win;
+	GC gc;
+	GC mask_gc;
+	XFontStruct *font;
+	int width;
+	int line_height;
+	/* every glyph box is mask_width x mask_height, plus shadow, with the
+	 * glyph origin at (origin_x, origin_y) */
+	int mask_width, mask_height;
+	int origin_x, origin_y;
+	int outline;
+	int shadow;
+	int hpos;
+	int hoffset;
+	unsigned long outline_pixel;
+	unsigned long shadow_pixel;
+	struct x11_glyph glyphs[256];
+	struct x11_cell cells[MAX_LINES + 1][LINE_SIZE];
+	int n_cells[MAX_LINES + 1];
+	/* every color shown, each is looked up once */
+	struct x11_color {
+		char name[COLOR_NAME_SIZE];
+		unsigned long pixel;
+	} *colors;
+	int n_colors;
+	int colors_size;
+} x11;
+
+unsigned long
+x11_color(const char *name)
+{
+	XColor color;
+	int i;
+
+	for (i = 0; i < x11.n_colors; i++)
+		if (!strncmp(x11.colors[i].name, name, COLOR_NAME_SIZE - 1))
+			return x11.colors[i].pixel;
+	if (!XParseColor(x11.dpy, DefaultColormap(x11.dpy, DefaultScreen(x11.dpy)), name, &color) ||
+			!XAllocColor(x11.dpy, DefaultColormap(x11.dpy, DefaultScreen(x11.dpy)), &color)) {
+		user_warn("Unknown color %s\n", name);
+		color.pixel = WhitePixel(x11.dpy, DefaultScreen(x11.dpy));
+	}
+	if (x11.n_colors == x11.colors_size) {
+		x11.colors_size = x11.colors_size ? x11.colors_size * 2 : 16;
+		x11.colors = realloc(x11.colors, x11.colors_size * sizeof(struct x11_color));
+	}
+	snprintf(x11.colors[x11.n_colors].name, COLOR_NAME_SIZE, "%s", name);
+	x11.colors[x11.n_colors++].pixel = color.pixel;
+	return color.pixel;
+}
+
+struct x11_glyph *
+x11_glyph(unsigned char c)
+{
+	struct x11_glyph *glyph = &x11.glyphs[c];
+	char s = c;
+	int dx, dy;
+
+	if (glyph->text != None)
+		return glyph;
+	glyph->text = XCreatePixmap(x11.dpy, x11.win, x11.mask_width, x11.mask_height, 1);
+	glyph->outline = XCreatePixmap(x11.dpy, x11.win, x11.mask_width, x11.mask_height, 1);
+	XSetForeground(x11.dpy, x11.mask_gc, 0);
+	XFillRectangle(x11.dpy, glyph->text, x11.mask_gc, 0, 0, x11.mask_width, x11.mask_height);
+	XFillRectangle(x11.dpy, glyph->outline, x11.mask_gc, 0, 0, x11.mask_width, x11.mask_height);
+	XSetForeground(x11.dpy, x11.mask_gc, 1);
+	XDrawString(x11.dpy, glyph->text, x11.mask_gc, x11.origin_x, x11.origin_y, &s, 1);
+	for (dy = -x11.outline; dy <= x11.outline; dy++)
+		for (dx = -x11.outline; dx <= x11.outline; dx++)
+			XDrawString(x11.dpy, glyph->outline, x11.mask_gc,
+					x11.origin_x + dx, x11.origin_y + dy, &s, 1);
+	return glyph;
+}
+
+void
+x11_cell_box(int number, const struct x11_cell *cell, XRectangle *box)
+{
+	box->x = cell->x - x11.origin_x;
+	box->y = number * x11.line_height;
+	box->width = x11.mask_width + x11.shadow;
+	box->height = x11.mask_height + x11.shadow;
+}
+
+int
+x11_boxes_intersect(const XRectangle *a, const XRectangle *b)
+{
+	return a->x < b->x + b->width && b->x < a->x + a->width &&
+		a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/* Fills color through mask placed at (x, y), and adds the mask to the shape */
+void
+x11_paint_mask(Pixmap mask, int x, int y, unsigned long pixel, int reshape)
+{
+	XSetClipMask(x11.dpy, x11.gc, mask);
+	XSetClipOrigin(x11.dpy, x11.gc, x, y);
+	XSetForeground(x11.dpy, x11.gc, pixel);
+	XFillRectangle(x11.dpy, x11.win, x11.gc, x, y, x11.mask_width, x11.mask_height);
+	if (reshape)
+		XShapeCombineMask(x11.dpy, x11.win, ShapeBounding, x, y, mask, ShapeUnion);
+}
+
+/* Draws cells of the given line numbers, in three passes so that no shadow or
+ * outline covers a neighbour's text. */
+void
+x11_draw_cells(const struct x11_cell **cells, const int *numbers, int n, int reshape)
+{
+	XRectangle box;
+	int pass, i;
+
+	for (pass = 0; pass < 3; pass++) {
+		if ((pass == 0 && !x11.shadow) || (pass == 1 && !x11.outline))
+			continue;
+		for (i = 0; i < n; i++) {
+			if (cells[i]->c == ' ')
+				continue;
+			x11_cell_box(numbers[i], cells[i], &box);
+			if (pass == 0)
+				x11_paint_mask(x11_glyph(cells[i]->c)->text, box.x + x11.shadow,
+						box.y + x11.shadow, x11.shadow_pixel, reshape);
+			else if (pass == 1)
+				x11_paint_mask(x11_glyph(cells[i]->c)->outline, box.x, box.y,
+						x11.outline_pixel, reshape);
+			else
+				x11_paint_mask(x11_glyph(cells[i]->c)->text, box.x, box.y,
+						cells[i]->pixel, reshape);
+		}
+	}
+}
+
+void
+x11_backend_create(const struct cfg *cfg, int n_lines)
+{
+	XSetWindowAttributes attributes;
+	int screen, height, y, event_base, error_base;
+	Pixmap pixmap;
+
+	if (!(x11.dpy = XOpenDisplay(NULL))) {
+		fprintf (stderr, "Error opening display\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!XShapeQueryExtension(x11.dpy, &event_base, &error_base)) {
+		fprintf (stderr, "X server has no SHAPE extension\n");
+		exit(EXIT_FAILURE);
+	}
+	screen = DefaultScreen(x11.dpy);
+
+	if (!cfg->font || !*cfg->font || !(x11.font = XLoadQueryFont(x11.dpy, cfg->font))) {
+		if (cfg->font && *cfg->font)
+			user_warn("Unable to load font %s\n", cfg->font);
+		x11.font = XLoadQueryFont(x11.dpy, "fixed");
+	}
+	x11.outline = cfg->outline_width;
+	x11.shadow = cfg->shadow;
+	x11.hpos = cfg->hpos;
+	x11.hoffset = cfg->hoffset;
+	x11.line_height = x11.font->ascent + x11.font->descent;
+	x11.origin_x = x11.outline - MIN(0, x11.font->min_bounds.lbearing);
+	x11.origin_y = x11.outline + x11.font->ascent;
+	x11.mask_width = x11.origin_x + x11.font->max_bounds.rbearing + x11.outline;
+	x11.mask_height = x11.line_height + 2 * x11.outline;
+
+	/* the first line is left empty, like with libxosd */
+	x11.width = DisplayWidth(x11.dpy, screen);
+	height = (n_lines + 1) * x11.line_height + 2 * x11.outline + x11.shadow;
+	switch (cfg->vpos) {
+		case XOSD_top: y = cfg->voffset; break;
+		case XOSD_middle: y = (DisplayHeight(x11.dpy, screen) - height) / 2 + cfg->voffset; break;
+		default: y = DisplayHeight(x11.dpy, screen) - height - cfg->voffset; break;
+	}
+
+	attributes.override_redirect = True;
+	x11.win = XCreateWindow(x11.dpy, RootWindow(x11.dpy, screen), 0, y, x11.width, height, 0,
+			CopyFromParent, InputOutput, CopyFromParent, CWOverrideRedirect, &attributes);
+	XSelectInput(x11.dpy, x11.win, ExposureMask);
+	XStoreName(x11.dpy, x11.win, "osd_monitors");
+	/* nothing is visible until some glyph is drawn */
+	XShapeCombineRectangles(x11.dpy, x11.win, ShapeBounding, 0, 0, NULL, 0, ShapeSet, YXBanded);
+
+	x11.gc = XCreateGC(x11.dpy, x11.win, 0, NULL);
+	pixmap = XCreatePixmap(x11.dpy, x11.win, 1, 1, 1);
+	x11.mask_gc = XCreateGC(x11.dpy, pixmap, 0, NULL);
+	XFreePixmap(x11.dpy, pixmap);
+	XSetFont(x11.dpy, x11.mask_gc, x11.font->fid);
+
+	x11.outline_pixel = x11_color(cfg->outline_color);
+	x11.shadow_pixel = BlackPixel(x11.dpy, screen);
+
+	XMapRaised(x11.dpy, x11.win);
+	XFlush(x11.dpy);
+}
+
+void
+x11_backend_update_line(const struct line *line, int text_changed)
+{
+	struct x11_cell new_cells[LINE_SIZE];
+	struct x11_cell *old_cells = x11.cells[line->number];
+	int n_old = x11.n_cells[line->number];
+	int n_new = strlen(line->text);
+	XRectangle erased[LINE_SIZE], box;
+	int n_erased = 0;
+	/* With thick outlines and shadows the repairs reach into any line, but
+	 * no cell is drawn twice */
+	static const struct x11_cell *draw[(MAX_LINES + 1) * LINE_SIZE];
+	static int draw_numbers[(MAX_LINES + 1) * LINE_SIZE];
+	int n_draw = 0;
+	unsigned long pixel = line->color ? x11_color(line->color) : 0;
+	int i, j, k, x;
+
+	x = XTextWidth(x11.font, line->text, n_new);
+	switch (x11.hpos) {
+		case XOSD_right: x = x11.width - x - x11.hoffset - x11.outline - x11.shadow; break;
+		case XOSD_center: x = (x11.width - x) / 2 + x11.hoffset; break;
+		default: x = x11.hoffset + x11.origin_x; break;
+	}
+	for (i = 0; i < n_new; i++) {
+		new_cells[i].c = line->text[i];
+		new_cells[i].x = x;
+		new_cells[i].pixel = pixel;
+		x += XTextWidth(x11.font, line->text + i, 1);
+	}
+
+	/* Both cell lists are sorted by x. Cells that are only in the old list
+	 * are erased, the ones only in the new list are drawn. */
+	for (i = j = 0; i < n_old || j < n_new;) {
+		if (i < n_old && j < n_new && old_cells[i].x == new_cells[j].x &&
+				old_cells[i].c == new_cells[j].c && old_cells[i].pixel == new_cells[j].pixel) {
+			i++, j++;
+		} else if (j == n_new || (i < n_old && old_cells[i].x <= new_cells[j].x)) {
+			if (old_cells[i].c != ' ')
+				x11_cell_box(line->number, &old_cells[i], &erased[n_erased++]);
+			i++;
+		} else {
+			draw[n_draw] = &x11.cells[line->number][j];
+			draw_numbers[n_draw++] = line->number;
+			j++;
+		}
+	}
+	if (!n_erased && !n_draw)
+		return;
+
+	memcpy(old_cells, new_cells, n_new * sizeof(struct x11_cell));
+	x11.n_cells[line->number] = n_new;
+
+	if (n_erased) {
+		XShapeCombineRectangles(x11.dpy, x11.win, ShapeBounding, 0, 0,
+				erased, n_erased, ShapeSubtract, Unsorted);
+		/* outlines and shadows overlap, unchanged neighbours of the erased
+		 * glyphs must be repaired */
+		for (k = 0; k < window.n_lines; k++) {
+			int number = window.lines[k].number;
+			for (i = 0; i < x11.n_cells[number]; i++) {
+				x11_cell_box(number, &x11.cells[number][i], &box);
+				for (j = 0; j < n_erased; j++)
+					if (x11_boxes_intersect(&box, &erased[j]))
+						break;
+				if (j == n_erased)
+					continue;
+				for (j = 0; j < n_draw; j++)
+					if (draw[j] == &x11.cells[number][i])
+						break;
+				if (j == n_draw) {
+					draw[n_draw] = &x11.cells[number][i];
+					draw_numbers[n_draw++] = number;
+				}
+			}
+		}
+	}
+	x11_draw_cells(draw, draw_numbers, n_draw, 1);
+	XFlush(x11.dpy);
+}
+
+void
+x11_backend_poll(void)
+{
+	const struct x11_cell *draw[LINE_SIZE];
+	int draw_numbers[LINE_SIZE];
+	XEvent event;
+	int exposed = 0, i, k, number;
+
+	while (XPending(x11.dpy)) {
+		XNextEvent(x11.dpy, &event);
+		if (event.type == Expose)
+			exposed = 1;
+	}
+	if (!exposed)
+		return;
+	/* the shape is still right, only the pixels are lost */
+	for (k = 0; k < window.n_lines; k++) {
+		number = window.lines[k].number;
+		for (i = 0; i < x11.n_cells[number]; i++) {
+			draw[i] = &x11.cells[number][i];
+			draw_numbers[i] = number;
+		}
+		x11_draw_cells(draw, draw_numbers, x11.n_cells[number], 0);
+	}
+	XFlush(x11.dpy);
+}
+
+void
+x11_backend_destroy(void)
+{
+	/* the window, pixmaps and GCs go with the connection */
+	XFreeFont(x11.dpy, x11.font);
+	XCloseDisplay(x11.dpy);
+	free(x11.colors);
+	memset(&x11, 0, sizeof(x11));
+}
+
+static const struct backend backends[] = {
+	{
+	name: "xosd",
+	create: xosd_backend_create,
+	update_line: xosd_backend_update_line,
+	poll: NULL,
+	destroy: xosd_backend_destroy,
+	},
+	{
+	name: "x11",
+	create: x11_backend_create,
+	update_line: x11_backend_update_line,
+	poll: x11_backend_poll,
+	destroy: x11_backend_destroy,
+	},
+};
+
+#define N_BACKENDS (sizeof(backends)/sizeof(struct backend))
+
+void
+window_create(const struct cfg *cfg, int n_lines)
+{
+	int i;
+
+	window.backend = backends;
+	for (i = 0; i < N_BACKENDS; i++)
+		if (!strcasecmp(cfg->backend, backends[i].name))
+			window.backend = backends + i;
+	if (strcasecmp(cfg->backend, window.backend->name))
+		user_warn("unknown backend: %s\n", cfg->backend);
+
+	window.n_lines = n_lines;
+	for (i = 0; i < n_lines; i++)
+		window.lines[i].number = i + 1;
+	window.backend->create(cfg, n_lines);
+}
+
+void
+window_destroy(void)
+{
+	window.backend->destroy();
+	memset(window.lines, 0, sizeof(window.lines));
+	window.n_lines = 0;
+}
+
+/* Blanks the line until its monitor shows something again */
+void
+line_clear(struct line *line)
+{
+	int text_changed = line->text[0] != '\0';
+
+	line->text[0] = '\0';
+	line->color = NULL;
+	if (text_changed)
+		window.backend->update_line(line, 1);
+}
+
+void
+window_hide(void)
+{
+	int i;
+
+	for (i = 0; i < window.n_lines; i++)
+		line_clear(window.lines + i);
+}
+
+void
+line_show(struct line *line, const char *color, const char *text)
+{
+	int text_changed;
+
+	if (line->color && !strcmp(line->color, color) && !strncmp(line->text, text, LINE_SIZE - 1))
+		return;
+	line->color = color;
+	text_changed = strncmp(line->text, text, LINE_SIZE - 1);
+	if (text_changed)
+		strncpy(line->text, text, LINE_SIZE - 1);
+	window.backend->update_line(line, text_changed);
+}
+
+/* Monitors *****************************************************************/
+
+/* shared */
+
+void *
+monitor_create_io_stats_data(const struct cfg *cfg)
+{
+	return malloc(sizeof(struct io_stats));
+}
+
+void 
+monitor_type_iospeed_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_io_stats_now, const void *_io_stats_before)
+{
+	char output[256];
+	const struct io_stats *io_stats_now = _io_stats_now;
+	const struct io_stats *io_stats_before = _io_stats_before;
+	struct io_stats stats_speed;
+
+	stats_speed.in = speed(io_stats_now->in, io_stats_before->in, t_now, t_before);
+	stats_speed.out = speed(io_stats_now->out, io_stats_before->out, t_now, t_before);
+	format_io_stats(output, sizeof(output), cfg->format, &stats_speed);
+	line_show(line, color_for_level(stats_speed.in + stats_speed.out, cfg), output);
+}
+
+struct counter_rates {
+	const struct counter_name *names;
+	float *rates;
+	int n;
+};
+
+int
+counter_rates_token(char *buf, int size, const char *spec, char conversion, const void *_rates)
+{
+	const struct counter_rates *rates = _rates;
+	int i;
+
+	for (i = 0; i < rates->n; i++)
+		if (rates->names[i].conversion == conversion) {
+			format_number(buf, rates->rates[i]);
+			return 1;
+		}
+	return 0;
+}
+
+void
+counter_rates_render(struct line *line, const struct cfg *cfg,
+		const struct counter_name *names, int n,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const uint64_t *counts_now, const uint64_t *counts_before)
+{
+	char output[256];
+	float rates[n], level = 0;
+	struct counter_rates counter_rates = {names, rates, n};
+	int i;
+
+	for (i = 0; i < n; i++) {
+		/* the counts outgrow the precision of a float, their deltas don't */
+		rates[i] = speed(counts_now[i] - counts_before[i], 0, t_now, t_before);
+		if (!cfg->level_key)
+			level += rates[i];
+		else if (!strcmp(cfg->level_key, names[i].name))
+			level = rates[i];
+	}
+	format_tokens(output, sizeof(output), cfg->format, counter_rates_token, &counter_rates);
+	line_show(line, color_for_level(level, cfg), output);
+}
+
+void 
+monitor_type_usage_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_usage_stats_now, const void *_usage_stats_before)
+{
+	char output[256];
+	struct usage_stats usage_stats = *(const struct usage_stats *)_usage_stats_now;
+
+	format_usage_stats(output, sizeof(output), cfg->format, &usage_stats);
+	line_show(line, color_for_level(USED_PERCENTAGE(usage_stats), cfg), output);
+}
+
+/* monitor clock */
+
+/* The smallest unit the format shows, the clock is redrawn only when it
+ * changes */
+enum clock_unit {
+	clock_second, clock_minute, clock_hour, clock_day,
+};
+
+void *
+monitor_type_clock_create_state(const struct cfg *cfg)
+{
+	enum clock_unit *unit = arena_alloc(cfg->arena, sizeof(enum clock_unit));
+	const char *f;
+
+	*unit = clock_day;
+	for (f = strchr(cfg->format, '%'); f && f[1]; f = strchr(f + 1, '%')) {
+		f++;
+		/* flags, width and the E and O modifiers */
+		for (; *f && strchr("_-^#0123456789EO", *f); f++);
+		if (!*f)
+			break;
+		if (strchr("sST+crX", *f))
+			*unit = clock_second;
+		else if (strchr("MR", *f))
+			*unit = MIN(*unit, clock_minute);
+		else if (strchr("HIklpPzZ", *f))
+			*unit = MIN(*unit, clock_hour);
+	}
+	return unit;
+}
+
+/* The start of the next unit of local time */
+void
+monitor_type_clock_next_tick(const struct cfg *cfg, const struct timeval *t_now, struct timeval *t_next)
+{
+	const enum clock_unit *unit = cfg->state;
+	time_t now = t_now->tv_sec;
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	switch (*unit) {
+		case clock_second: t_next->tv_sec = now + 1; break;
+		case clock_minute: t_next->tv_sec = now - tm.tm_sec + 60; break;
+		case clock_hour: t_next->tv_sec = now - tm.tm_sec - tm.tm_min * 60 + 3600; break;
+		default:
+			/* days are not always 24 hours long */
+			tm.tm_mday++;
+			tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+			tm.tm_isdst = -1;
+			t_next->tv_sec = mktime(&tm);
+	}
+	t_next->tv_usec = 0;
+}
+
+void 
+monitor_type_clock_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_stats_now, const void *_stats_before)
+{
+	char output[256];
+	time_t now = t_now->tv_sec;
+	struct tm tm;
+
+	/* unlike localtime, localtime_r does not reload the time zone (and
+	 * allocate) every call */
+	strftime(output, sizeof(output) - 1, cfg->format, localtime_r(&now, &tm));
+	line_show(line, cfg->color, output);
+}
+
+/* monitor cpu */
+
+/* Columns of a cpu line in /proc/stat, in jiffies. guest and guest_nice are
+ * already included in user and nice. */
+enum cpu_field {
+	cpu_user, cpu_nice, cpu_system, cpu_idle, cpu_iowait,
+	cpu_irq, cpu_softirq, cpu_steal, cpu_guest, cpu_guest_nice,
+	cpu_busy, /* not a column: user + nice + system + irq + softirq */
+	N_CPU_FIELDS
+};
+
+static const struct cpu_field_name {
+	const char *name;
+	char conversion;
+} cpu_field_names[N_CPU_FIELDS] = {
+	{"user", 'u'}, {"nice", 'n'}, {"system", 's'}, {"idle", 'i'}, {"iowait", 'w'},
+	{"irq", 'q'}, {"softirq", 'Q'}, {"steal", 'S'}, {"guest", 'g'}, {"guest_nice", 'G'},
+	{"busy", 'f'},
+};
+
+struct cpu_stats {
+	float jiffies[N_CPU_FIELDS - 1];
+};
+
+/* The state is the field level colors are keyed on */
+void *
+monitor_type_cpu_create_state(const struct cfg *cfg)
+{
+	enum cpu_field *level_field = arena_alloc(cfg->arena, sizeof(enum cpu_field));
+
+	*level_field = cpu_busy;
+	if (cfg->level_key) {
+		for (*level_field = 0; *level_field < N_CPU_FIELDS; (*level_field)++)
+			if (!strcmp(cfg->level_key, cpu_field_names[*level_field].name))
+				break;
+		if (*level_field == N_CPU_FIELDS) {
+			user_warn("unknown cpu level key: %s\n", cfg->level_key);
+			*level_field = cpu_busy;
+		}
+	}
+	return level_field;
+}
+
+void
+monitor_type_cpu_retrieve_stats(void *_stats, const struct cfg *cfg)
+{
+	struct cpu_stats *stats = _stats;
+	float *j = stats->jiffies;
+
+	read_columns_from_file("/proc/stat", cfg->device, 10,
+			1, j + cpu_user, 2, j + cpu_nice, 3, j + cpu_system, 4, j + cpu_idle,
+			5, j + cpu_iowait, 6, j + cpu_irq, 7, j + cpu_softirq, 8, j + cpu_steal,
+			9, j + cpu_guest, 10, j + cpu_guest_nice);
+}
+
+/* data are the shares of fields in % */
+int
+cpu_stats_token(char *buf, int size, const char *spec, char conversion, const void *_shares)
+{
+	const float *shares = _shares;
+	int i;
+
+	/* 'b' is an alias of busy, 'f' works with the old printf formats */
+	if (conversion == 'b')
+		conversion = 'f';
+	for (i = 0; i < N_CPU_FIELDS; i++)
+		if (cpu_field_names[i].conversion == conversion) {
+			format_float(buf, size, spec, ".1", shares[i]);
+			return 1;
+		}
+	return 0;
+}
+
+void 
+monitor_type_cpu_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_stats_now, const void *_stats_before)
+{
+	char output[256];
+	const struct cpu_stats *stats_now = _stats_now, *stats_before = _stats_before;
+	const enum cpu_field *level_field = cfg->state;
+	float shares[N_CPU_FIELDS];
+	float total = 0;
+	int i;
+
+	for (i = 0; i < N_CPU_FIELDS - 1; i++)
+		shares[i] = stats_now->jiffies[i] - stats_before->jiffies[i];
+	for (i = cpu_user; i <= cpu_steal; i++)
+		total += shares[i];
+	shares[cpu_busy] = shares[cpu_user] + shares[cpu_nice] + shares[cpu_system] +
+		shares[cpu_irq] + shares[cpu_softirq];
+	for (i = 0; i < N_CPU_FIELDS; i++)
+		shares[i] = total ? 100.0 * shares[i] / total : 0;
+
+	format_tokens(output, sizeof(output), cfg->format, cpu_stats_token, shares);
+	line_show(line, color_for_level(shares[*level_field], cfg), output);
+}
+
+/* monitor ctxt */
+
+void
+monitor_type_ctxt_retrieve_stats(void *_io_stats, const struct cfg *cfg)
+{
+	struct io_stats *io_stats = _io_stats;
+	float ctxt;
+
+	read_columns_from_file("/proc/stat", "ctxt", 1, 1, &ctxt);
+	io_stats->in = ctxt;
+	io_stats->out = 0;
+}
+
+/* monitor running processes */
+
+void
+monitor_type_runps_retrieve_stats(void *_stats, const struct cfg *cfg)
+{
+	read_columns_from_file("/proc/stat", "procs_running", 1, 1, (float *)_stats);
+}
+
+void 
+monitor_type_runps_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_stats_now, const void *_stats_before)
+{
+	char output[256];
+	const float *running_processes = _stats_now;
+
+	snprintf(output, sizeof(output) - 1, cfg->format, *running_processes);
+	line_show(line, cfg->color, output);
+}
+
+/* monitor run queue waits */
+
+#define SCHEDSTAT_MAX_CPUS 512
+/* run_delay is the 8th number of the cpu lines */
+#define SCHEDSTAT_RUN_DELAY 7
+
+/* The stats have a fixed size for --record, cpus past SCHEDSTAT_MAX_CPUS only
+ * count for all of them */
+struct schedstat_stats {
+	int n_cpus;
+	uint64_t all; /* ns */
+	uint64_t run_delay[SCHEDSTAT_MAX_CPUS]; /* ns, by cpu number */
+};
+
+struct schedstat_rates {
+	float all; /* ms/s */
+	float worst;
+	int worst_cpu;
+};
+
+void
+monitor_type_schedstat_retrieve_stats(void *_stats, const struct cfg *cfg)
+{
+	struct schedstat_stats *stats = _stats;
+	const char *line, *line_end, *end;
+	uint64_t values[SCHEDSTAT_RUN_DELAY + 1];
+	size_t len;
+	char *number_end;
+	int cpu;
+	static int warned = 0;
+
+	line = source_read(source_open("/proc/schedstat"), &len);
+	end = line + len;
+	stats->n_cpus = 0;
+	stats->all = 0;
+	for (; line < end; line = line_end + 1) {
+		line_end = memchr(line, '\n', end - line);
+		if (!line_end)
+			line_end = end;
+		if (strncmp(line, "cpu", 3))
+			continue;
+		cpu = strtol(line + 3, &number_end, 10);
+		if (scan_numbers(number_end, line_end, values, SCHEDSTAT_RUN_DELAY + 1) <= SCHEDSTAT_RUN_DELAY)
+			continue;
+		stats->all += values[SCHEDSTAT_RUN_DELAY];
+		if (cpu >= SCHEDSTAT_MAX_CPUS) {
+			if (!warned++)
+				user_warn("schedstat: cpus from %d on only count for all cpus\n", SCHEDSTAT_MAX_CPUS);
+			continue;
+		}
+		/* offline cpus have no line */
+		for (; stats->n_cpus <= cpu; stats->n_cpus++)
+			stats->run_delay[stats->n_cpus] = 0;
+		stats->run_delay[cpu] = values[SCHEDSTAT_RUN_DELAY];
+	}
+}
+
+int
+schedstat_token(char *buf, int size, const char *spec, char conversion, const void *_rates)
+{
+	const struct schedstat_rates *rates = _rates;
+
+	switch (conversion) {
+		case 'a': format_float(buf, size, spec, ".1", rates->all); break;
+		case 'w': format_float(buf, size, spec, ".1", rates->worst); break;
+		case 'c': snprintf(buf, size, "%d", rates->worst_cpu); break;
+		default: return 0;
+	}
+	return 1;
+}
+
+void 
+monitor_type_schedstat_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_stats_now, const void *_stats_before)
+{
+	const struct schedstat_stats *now = _stats_now, *before = _stats_before;
+	struct schedstat_rates rates = {0, 0, 0};
+	char output[256];
+	float rate;
+	int cpu;
+
+	for (cpu = 0; cpu < MIN(now->n_cpus, before->n_cpus); cpu++) {
+		if (now->run_delay[cpu] < before->run_delay[cpu])
+			continue;
+		rate = speed(now->run_delay[cpu] - before->run_delay[cpu], 0, t_now, t_before) / 1000000.0;
+		if (rate > rates.worst) {
+			rates.worst = rate;
+			rates.worst_cpu = cpu;
+		}
+	}
+	/* a cpu going offline takes its run_delay with it */
+	if (now->all >= before->all)
+		rates.all = speed(now->all - before->all, 0, t_now, t_before) / 1000000.0;
+	format_tokens(output, sizeof(output), cfg->format, schedstat_token, &rates);
+	line_show(line, color_for_level(cfg->level_key && !strcmp(cfg->level_key, "all") ?
+				rates.all : rates.worst, cfg), output);
+}
+
+/* monitor mem */
+
+void
+monitor_type_memory_retrieve_stats(void *_usage_stats, const struct cfg *cfg)
+{
+	struct usage_stats *usage_stats = _usage_stats;
+	float total, free, buffers, cached;
+
+	read_lines_from_file("/proc/meminfo", 4, 
+			"MemTotal:", &total, 
+			"MemFree:", &free, 
+			"Buffers:", &buffers, 
+			"Cached:", &cached);
+
+	/* This is the way htop computes used memory, and it makes sense. 
+	   See http://ubuntuforums.org/showthread.php?t=393176 */
+	usage_stats->free = (free + buffers + cached) * 1024;
+	usage_stats->total = total * 1024;
+}
+
+/* monitor swap */
+
+void
+monitor_type_swap_retrieve_stats(void *_usage_stats, const struct cfg *cfg)
+{
+	struct usage_stats *usage_stats = _usage_stats;
+	float total, free;
+
+	read_lines_from_file("/proc/meminfo", 2, 
+			"SwapTotal:", &total, 
+			"SwapFree:", &free);
+
+	usage_stats->free = free * 1024.0;
+	usage_stats->total = total * 1024.0;
+}
+
+/* /proc/vmstat is "name value" lines in an order that does not change while
+ * running, so the names are looked up once and the values then read by line
+ * number */
+
+#define VMSTAT_MAX_FIELDS 16
+
+struct vmstat_table {
+	struct source *source;
+	int n;
+	int lines[VMSTAT_MAX_FIELDS]; /* ascending */
+	int counters[VMSTAT_MAX_FIELDS];
+};
+
+/* Counter i is the value of names[i], or the sum of all the lines starting
+ * with it when it ends with '*' (e.g. the allocstall_<zone> lines) */
+void
+vmstat_table_resolve(struct vmstat_table *table, const char *const *names, int n_names)
+{
+	const char *line, *line_end, *end;
+	size_t len, name_len;
+	int n_line, i, found[n_names];
+
+	memset(found, 0, sizeof(found));
+	table->source = source_open("/proc/vmstat");
+	line = source_read(table->source, &len);
+	end = line + len;
+	for (n_line = 0; line < end; line = line_end + 1, n_line++) {
+		if (!(line_end = memchr(line, ' ', end - line)))
+			break;
+		for (i = 0; i < n_names && table->n < VMSTAT_MAX_FIELDS; i++) {
+			name_len = strlen(names[i]);
+			if (names[i][name_len - 1] == '*' ?
+					strncmp(line, names[i], name_len - 1) :
+					name_len != (size_t)(line_end - line) || strncmp(line, names[i], name_len))
+				continue;
+			table->lines[table->n] = n_line;
+			table->counters[table->n++] = i;
+			found[i] = 1;
+			break;
+		}
+		if (!(line_end = memchr(line_end, '\n', end - line_end)))
+			break;
+	}
+	for (i = 0; i < n_names; i++)
+		if (!found[i])
+			warn("vmstat: %s not found in /proc/vmstat\n", names[i]);
+}
+
+void
+vmstat_table_read(const struct vmstat_table *table, uint64_t *values, int n_values)
+{
+	const char *line, *end;
+	size_t len;
+	int n_line = 0, i;
+
+	memset(values, 0, n_values * sizeof(uint64_t));
+	line = source_read(table->source, &len);
+	end = line + len;
+	for (i = 0; i < table->n && line < end; i++) {
+		for (; n_line < table->lines[i] && line; n_line++)
+			if ((line = memchr(line, '\n', end - line)))
+				line++;
+		if (!line || !(line = memchr(line, ' ', end - line)))
+			break;
+		values[table->counters[i]] += strtoull(line, NULL, 10);
+	}
+}
+
+/* monitor swapping activity */
+
+static const char *const swapact_names[] = {"pswpin", "pswpout"};
+
+void *
+monitor_type_swapact_create_state(const struct cfg *cfg)
+{
+	struct vmstat_table *table = arena_alloc(cfg->arena, sizeof(struct vmstat_table));
+
+	vmstat_table_resolve(table, swapact_names, 2);
+	return table;
+}
+
+void
+monitor_type_swapact_retrieve_stats(void *_io_stats, const struct cfg *cfg)
+{
+	struct io_stats *io_stats = _io_stats;
+	uint64_t values[2];
+
+	vmstat_table_read(cfg->state, values, 2);
+	io_stats->in = (float)values[0] * PAGE_SIZE;
+	io_stats->out = (float)values[1] * PAGE_SIZE;
+}
+
+/* monitor memory reclaim and paging activity */
+
+enum vmstat_counter {
+	vmstat_pgmajfault, vmstat_pgscan_direct, vmstat_pgsteal_kswapd,
+	vmstat_allocstall, vmstat_compact_stall, vmstat_oom_kill,
+	N_VMSTAT_COUNTERS
+};
+
+static const char *const vmstat_fields[N_VMSTAT_COUNTERS] = {
+	"pgmajfault", "pgscan_direct", "pgsteal_kswapd", "allocstall*", "compact_stall", "oom_kill",
+};
+
+static const struct counter_name vmstat_names[N_VMSTAT_COUNTERS] = {
+	{"pgmajfault", 'f'}, {"pgscan_direct", 's'}, {"pgsteal_kswapd", 'k'},
+	{"allocstall", 'a'}, {"compact_stall", 'c'}, {"oom_kill", 'o'},
+};
+
+struct vmstat_stats {
+	uint64_t counts[N_VMSTAT_COUNTERS];
+};
+
+void *
+monitor_type_vmstat_create_state(const struct cfg *cfg)
+{
+	struct vmstat_table *table = arena_alloc(cfg->arena, sizeof(struct vmstat_table));
+
+	vmstat_table_resolve(table, vmstat_fields, N_VMSTAT_COUNTERS);
+	return table;
+}
+
+void
+monitor_type_vmstat_retrieve_stats(void *_stats, const struct cfg *cfg)
+{
+	struct vmstat_stats *stats = _stats;
+
+	vmstat_table_read(cfg->state, stats->counts, N_VMSTAT_COUNTERS);
+}
+
+void
+monitor_type_vmstat_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_stats_now, const void *_stats_before)
+{
+	const struct vmstat_stats *now = _stats_now, *before = _stats_before;
+
+	counter_rates_render(line, cfg, vmstat_names, N_VMSTAT_COUNTERS,
+			t_now, t_before, now->counts, before->counts);
+}
+
+/* monitor disk usage */
+
+void
+monitor_type_disk_retrieve_stats(void *_usage_stats, const struct cfg *cfg)
+{
+	struct usage_stats *usage_stats = _usage_stats;
+	struct statvfs stat_struct;
+
+	if (statvfs(cfg->device, &stat_struct)) {
+		user_warn("Unable to statvfs %s: %s\n", cfg->device, strerror(errno));
+		usage_stats->total = usage_stats->free = 0;
+		return;
+	}
+	usage_stats->total = (float)stat_struct.f_blocks * (float)stat_struct.f_frsize;
+	usage_stats->free = (float)stat_struct.f_bavail * (float)stat_struct.f_bsize;
+}
+
+void 
+monitor_type_disk_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_stats_now, const void *_stats_before)
+{
+	const struct usage_stats *usage_stats = _stats_now;
+
+	if (usage_stats->total)
+		monitor_type_usage_render(line, cfg, t_now, t_before, _stats_now, _stats_before);
+}
+
+/* monitor usage of multiple mount points */
+
+/* Mount points are statvfs'd one after another in a separate thread, each one
+ * at most once per DISKS_STATVFS_INTERVAL seconds, so that a hung (e.g. NFS)
+ * mount never blocks the display. It does stall that thread though, and with
+ * it the numbers of every mount and the mount table, which is re-read only
+ * when the kernel signals a change on /proc/self/mountinfo. So results older
+ * than DISKS_MAX_AGE are not shown, only counted as stale. */
+
+#define DISKS_MAX_MOUNTS 256
+#define DISKS_MAX_SHOWN 3
+#define DISKS_MOUNT_POINT_SIZE 128
+/* mountinfo lines, longer ones are skipped */
+#define DISKS_LINE_SIZE 4096
+#define DISKS_STATVFS_INTERVAL 10
+#define DISKS_MAX_AGE (3 * DISKS_STATVFS_INTERVAL)
+
+struct disks_mount {
+	char mount_point[DISKS_MOUNT_POINT_SIZE];
+	struct usage_stats usage;
+	int valid;
+	int warned;
+	time_t next_statvfs;
+	time_t updated; /* of the last successful statvfs */
+};
+
+/* Not in the arena: the thread may be stuck in statvfs of a hung mount when
+ * the monitor goes away, so it frees the state itself when it sees quit */
+struct disks_state {
+	char *patterns;
+	int quit;
+	FILE *mountinfo;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct disks_mount mounts[DISKS_MAX_MOUNTS];
+	int n_mounts;
+};
+
+struct disks_stats {
+	int n;
+	int n_stale;
+	char mount_point[DISKS_MAX_SHOWN][DISKS_MOUNT_POINT_SIZE];
+	struct usage_stats usage[DISKS_MAX_SHOWN];
+};
+
+/* patterns is a comma separated list of mount point globs, or of
+ * "type:fstype" globs matched against the filesystem type */
+int
+disks_mount_matches(const char *patterns, const char *mount_point, const char *fstype)
+{
+	char pattern[DISKS_MOUNT_POINT_SIZE];
+	const char *end;
+	size_t len;
+
+	while (*patterns) {
+		end = strchrnul(patterns, ',');
+		len = MIN(end - patterns, sizeof(pattern) - 1);
+		memcpy(pattern, patterns, len);
+		pattern[len] = '\0';
+		if (!strncmp(pattern, "type:", 5)) {
+			if (!fnmatch(pattern + 5, fstype, 0))
+				return 1;
+		} else if (!fnmatch(pattern, mount_point, 0))
+			return 1;
+		patterns = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+/* mountinfo escapes spaces etc. as \ooo, anything else is left as is */
+void
+disks_unescape(char *s)
+{
+	char *d = s;
+	for (; *s; s++) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' &&
+				s[3] >= '0' && s[3] <= '7') {
+			*d++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+			s += 3;
+		} else
+			*d++ = *s;
+	}
+	*d = '\0';
+}
+
+/* Re-reads the mount table. Mounts that are still there keep their last
+ * statvfs result and schedule. */
+void
+disks_read_mountinfo(struct disks_state *state)
+{
+	struct disks_mount mounts[DISKS_MAX_MOUNTS];
+	int n_mounts = 0;
+	char line[DISKS_LINE_SIZE];
+	char *saveptr, *token, *mount_point, *fstype;
+	int i, j, c;
+
+	rewind(state->mountinfo);
+	while (fgets(line, sizeof(line), state->mountinfo) && n_mounts < DISKS_MAX_MOUNTS) {
+		if (!strchr(line, '\n') && !feof(state->mountinfo)) {
+			while ((c = getc(state->mountinfo)) != EOF && c != '\n');
+			continue;
+		}
+		/* id parent major:minor root mount_point options [optional...] - fstype ... */
+		mount_point = NULL;
+		fstype = NULL;
+		token = strtok_r(line, " ", &saveptr);
+		for (i = 1; token; i++) {
+			token = strtok_r(NULL, " ", &saveptr);
+			if (i == 4)
+				mount_point = token;
+			if (i > 5 && token && !strcmp(token, "-")) {
+				fstype = strtok_r(NULL, " ", &saveptr);
+				break;
+			}
+		}
+		if (!mount_point || !fstype)
+			continue;
+		disks_unescape(mount_point);
+		if (!disks_mount_matches(state->patterns, mount_point, fstype))
+			continue;
+		/* the same mount point may be mounted over, the last one wins */
+		for (j = 0; j < n_mounts; j++)
+			if (!strcmp(mounts[j].mount_point, mount_point))
+				break;
+		memset(&mounts[j], 0, sizeof(struct disks_mount));
+		strncpy(mounts[j].mount_point, mount_point, DISKS_MOUNT_POINT_SIZE - 1);
+		if (j == n_mounts)
+			n_mounts++;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	for (j = 0; j < n_mounts; j++)
+		for (i = 0; i < state->n_mounts; i++)
+			if (!strcmp(mounts[j].mount_point, state->mounts[i].mount_point)) {
+				memcpy(&mounts[j], &state->mounts[i], sizeof(struct disks_mount));
+				break;
+			}
+	memcpy(state->mounts, mounts, n_mounts * sizeof(struct disks_mount));
+	state->n_mounts = n_mounts;
+	pthread_mutex_unlock(&state->lock);
+}
+
+void *
+disks_thread(void *_state)
+{
+	struct disks_state *state = _state;
+	struct pollfd pfd;
+	struct statvfs stat_struct;
+	char mount_point[DISKS_MOUNT_POINT_SIZE];
+	time_t now, next;
+	int i, ok;
+
+	pfd.fd = fileno(state->mountinfo);
+	pfd.events = POLLPRI;
+	disks_read_mountinfo(state);
+	while (1) {
+		/* Pick one mount that is due, statvfs it without holding the lock.
+		 * The table may change meanwhile, so the result is stored by name. */
+		now = time(NULL);
+		next = now + DISKS_STATVFS_INTERVAL;
+		mount_point[0] = '\0';
+		pthread_mutex_lock(&state->lock);
+		if (state->quit) {
+			pthread_mutex_unlock(&state->lock);
+			break;
+		}
+		for (i = 0; i < state->n_mounts; i++) {
+			if (state->mounts[i].next_statvfs <= now && !mount_point[0])
+				strcpy(mount_point, state->mounts[i].mount_point);
+			else if (state->mounts[i].next_statvfs < next)
+				next = state->mounts[i].next_statvfs;
+		}
+		pthread_mutex_unlock(&state->lock);
+
+		if (mount_point[0]) {
+			ok = !statvfs(mount_point, &stat_struct);
+			pthread_mutex_lock(&state->lock);
+			for (i = 0; i < state->n_mounts; i++) {
+				struct disks_mount *m = &state->mounts[i];
+				if (strcmp(m->mount_point, mount_point))
+					continue;
+				m->next_statvfs = time(NULL) + DISKS_STATVFS_INTERVAL;
+				m->valid = ok && stat_struct.f_blocks;
+				if (m->valid) {
+					m->updated = time(NULL);
+					m->usage.total = (float)stat_struct.f_blocks * (float)stat_struct.f_frsize;
+					m->usage.free = (float)stat_struct.f_bavail * (float)stat_struct.f_bsize;
+				} else if (!ok && !m->warned) {
+					user_warn("Unable to statvfs %s: %s\n", mount_point, strerror(errno));
+					m->warned = 1;
+				}
+				break;
+			}
+			pthread_mutex_unlock(&state->lock);
+			continue;
+		}
+
+		if (poll(&pfd, 1, (next - now) * 1000) > 0 && (pfd.revents & (POLLPRI | POLLERR)))
+			disks_read_mountinfo(state);
+	}
+	fclose(state->mountinfo);
+	pthread_mutex_destroy(&state->lock);
+	free(state->patterns);
+	free(state);
+	return NULL;
+}
+
+void *
+monitor_type_disks_create_state(const struct cfg *cfg)
+{
+	struct disks_state *state = calloc(1, sizeof(struct disks_state));
+
+	state->patterns = strdup(cfg->device);
+	if (NULL == (state->mountinfo = fopen("/proc/self/mountinfo", "r"))) {
+		perror("fopen");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&state->lock, NULL);
+	if ((errno = pthread_create(&state->thread, NULL, disks_thread, state))) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(state->thread);
+	return state;
+}
+
+/* The thread notices within DISKS_STATVFS_INTERVAL */
+void
+monitor_type_disks_destroy_state(const struct cfg *cfg)
+{
+	struct disks_state *state = cfg->state;
+
+	pthread_mutex_lock(&state->lock);
+	state->quit = 1;
+	pthread_mutex_unlock(&state->lock);
+}
+
+/* Copies the DISKS_MAX_SHOWN fullest mounts from the last statvfs results. */
+void
+monitor_type_disks_retrieve_stats(void *_stats, const struct cfg *cfg)
+{
+	struct disks_stats *stats = _stats;
+	struct disks_state *state = cfg->state;
+	int shown[DISKS_MAX_SHOWN];
+	time_t oldest = time(NULL) - DISKS_MAX_AGE;
+	int i, j, best;
+
+	pthread_mutex_lock(&state->lock);
+	stats->n_stale = 0;
+	for (i = 0; i < state->n_mounts; i++)
+		if (state->mounts[i].valid && state->mounts[i].updated < oldest)
+			stats->n_stale++;
+	for (stats->n = 0; stats->n < DISKS_MAX_SHOWN; stats->n++) {
+		best = -1;
+		for (i = 0; i < state->n_mounts; i++) {
+			if (!state->mounts[i].valid || state->mounts[i].updated < oldest)
+				continue;
+			for (j = 0; j < stats->n && shown[j] != i; j++);
+			if (j < stats->n)
+				continue;
+			if (best == -1 || USED_PERCENTAGE(state->mounts[i].usage) > USED_PERCENTAGE(state->mounts[best].usage))
+				best = i;
+		}
+		if (best == -1)
+			break;
+		shown[stats->n] = best;
+		strcpy(stats->mount_point[stats->n], state->mounts[best].mount_point);
+		stats->usage[stats->n] = state->mounts[best].usage;
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+void 
+monitor_type_disks_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_stats_now, const void *_stats_before)
+{
+	const struct disks_stats *stats = _stats_now;
+	char output[256], format[256];
+	const char *f, *s;
+	char *o, *d;
+	int i;
+
+	o = output;
+	*o = '\0';
+	for (i = 0; i < stats->n; i++) {
+		/* %m is the mount point, the rest is handled by format_usage_stats */
+		d = format;
+		for (f = cfg->format; *f && d < format + sizeof(format) - 3; f++) {
+			if (f[0] == '%' && f[1] == 'm') {
+				for (s = stats->mount_point[i]; *s && d < format + sizeof(format) - 3; s++) {
+					if (*s == '%')
+						*d++ = '%';
+					*d++ = *s;
+				}
+				f++;
+			} else
+				*d++ = *f;
+		}
+		*d = '\0';
+		if (i && o < output + sizeof(output) - 2)
+			*o++ = ' ';
+		format_usage_stats(o, output + sizeof(output) - o, format, (struct usage_stats *)&stats->usage[i]);
+		o += strlen(o);
+	}
+	if (stats->n_stale)
+		snprintf(o, output + sizeof(output) - o, "%s%d stale", stats->n ? " " : "", stats->n_stale);
+	line_show(line, stats->n ? color_for_level(USED_PERCENTAGE(stats->usage[0]), cfg) : cfg->color, output);
+}
+
+/* monitor disk activity */
+
+void
+monitor_type_diskact_retrieve_stats(void *_io_stats, const struct cfg *cfg)
+{
+	struct io_stats *io_stats = _io_stats;
+	float in, out;
+
+	read_columns_from_file("/proc/diskstats", cfg->device, 2, 5, &in, 9, &out);
+	io_stats->in = in * SECTOR_SIZE;
+	io_stats->out = out * SECTOR_SIZE;
+}
+
+/* monitor net */
+
+void
+monitor_type_net_retrieve_stats(void *_io_stats, const struct cfg *cfg)
+{
+	struct io_stats *io_stats = _io_stats;
+	float in, out;
+
+	read_columns_from_file("/proc/net/dev", cfg->device, 2, 1, &in, 9, &out);
+	io_stats->in = in;
+	io_stats->out = out;
+}
+
+/* monitor perf software events */
+
+enum perf_counter {
+	perf_page_faults, perf_context_switches, perf_cpu_migrations,
+	N_PERF_COUNTERS
+};
+
+static const uint64_t perf_configs[N_PERF_COUNTERS] = {
+	PERF_COUNT_SW_PAGE_FAULTS, PERF_COUNT_SW_CONTEXT_SWITCHES, PERF_COUNT_SW_CPU_MIGRATIONS,
+};
+
+static const struct counter_name perf_names[N_PERF_COUNTERS] = {
+	{"faults", 'f'}, {"switches", 'c'}, {"migrations", 'm'},
+};
+
+/* One group per cpu, its leader is the first counter */
+struct perf_state {
+	int n_groups;
+	int *leaders;
+	int *fds; /* n_groups * N_PERF_COUNTERS, to keep them open */
+};
+
+struct perf_stats {
+	uint64_t counts[N_PERF_COUNTERS];
+};
+
+/* Opens the counters of one cpu, returns the group leader or -1 */
+int
+perf_open_group(struct perf_state *state, int cgroup, int cpu)
+{
+	struct perf_event_attr attr;
+	int i, fd, leader = -1;
+
+	for (i = 0; i < N_PERF_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = perf_configs[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		fd = syscall(SYS_perf_event_open, &attr, cgroup, cpu, leader,
+				PERF_FLAG_FD_CLOEXEC | (cgroup == -1 ? 0 : PERF_FLAG_PID_CGROUP));
+		if (fd == -1) {
+			for (i--; i >= 0; i--)
+				close(state->fds[state->n_groups * N_PERF_COUNTERS + i]);
+			return -1;
+		}
+		state->fds[state->n_groups * N_PERF_COUNTERS + i] = fd;
+		if (leader == -1)
+			leader = fd;
+	}
+	state->leaders[state->n_groups++] = leader;
+	return leader;
+}
+
+/* device is "all" (every cpu), "cpuN", or a cgroup, either a path or
+ * relative to /sys/fs/cgroup */
+void *
+monitor_type_perf_create_state(const struct cfg *cfg)
+{
+	struct perf_state *state = arena_alloc(cfg->arena, sizeof(struct perf_state));
+	char path[PATH_MAX], *end;
+	int n_cpus = sysconf(_SC_NPROCESSORS_CONF), cgroup = -1, cpu, first = 0, last = n_cpus - 1;
+
+	if (!strncmp(cfg->device, "cpu", 3) && cfg->device[3] >= '0' && cfg->device[3] <= '9') {
+		first = last = strtol(cfg->device + 3, &end, 10);
+		if (*end || first >= n_cpus) {
+			user_warn("perf: %s is not a cpu (cpu0 to cpu%d)\n", cfg->device, n_cpus - 1);
+			return state;
+		}
+	} else if (strcmp(cfg->device, "all")) {
+		snprintf(path, sizeof(path), "%s%s", *cfg->device == '/' ? "" : "/sys/fs/cgroup/", cfg->device);
+		if (-1 == (cgroup = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC))) {
+			user_warn("perf: %s: %s\n", path, strerror(errno));
+			return state;
+		}
+	}
+	state->leaders = arena_alloc(cfg->arena, n_cpus * sizeof(int));
+	state->fds = arena_alloc(cfg->arena, n_cpus * N_PERF_COUNTERS * sizeof(int));
+	for (cpu = first; cpu <= last && cpu < n_cpus; cpu++) {
+		if (-1 != perf_open_group(state, cgroup, cpu))
+			continue;
+		/* offline cpus have no counters */
+		if (errno == ENODEV) {
+			if (first == last)
+				user_warn("perf: cpu %d is offline\n", cpu);
+			continue;
+		}
+		warn("perf: perf_event_open for cpu %d: %s%s\n", cpu, strerror(errno),
+				errno == EACCES ? " (see /proc/sys/kernel/perf_event_paranoid)" : "");
+		break;
+	}
+	/* the counters keep the cgroup */
+	if (cgroup != -1)
+		close(cgroup);
+	return state;
+}
+
+void
+monitor_type_perf_destroy_state(const struct cfg *cfg)
+{
+	struct perf_state *state = cfg->state;
+	int i;
+
+	for (i = 0; i < state->n_groups * N_PERF_COUNTERS; i++)
+		close(state->fds[i]);
+}
+
+void
+monitor_type_perf_retrieve_stats(void *_stats, const struct cfg *cfg)
+{
+	struct perf_stats *stats = _stats;
+	struct perf_state *state = cfg->state;
+	struct {
+		uint64_t nr;
+		uint64_t values[N_PERF_COUNTERS];
+	} group;
+	int i, j;
+
+	memset(stats, 0, sizeof(struct perf_stats));
+	/* one read per cpu gets all of its counters */
+	for (i = 0; i < state->n_groups; i++) {
+		if (read(state->leaders[i], &group, sizeof(group)) != sizeof(group)) {
+			warn("perf: read: %s\n", strerror(errno));
+			continue;
+		}
+		for (j = 0; j < N_PERF_COUNTERS; j++)
+			stats->counts[j] += group.values[j];
+	}
+}
+
+void 
+monitor_type_perf_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_stats_now, const void *_stats_before)
+{
+	const struct perf_stats *now = _stats_now, *before = _stats_before;
+
+	counter_rates_render(line, cfg, perf_names, N_PERF_COUNTERS,
+			t_now, t_before, now->counts, before->counts);
+}
+
+/* monitor network protocol errors */
+
+enum netproto_counter {
+	netproto_retrans_segs, netproto_listen_drops, netproto_in_errs, netproto_rcvbuf_errors,
+	N_NETPROTO_COUNTERS
+};
+
+static const struct netproto_field {
+	const char *file;
+	const char *prefix;
+	const char *field;
+} netproto_fields[N_NETPROTO_COUNTERS] = {
+	{"/proc/net/snmp", "Tcp", "RetransSegs"},
+	{"/proc/net/netstat", "TcpExt", "ListenDrops"},
+	{"/proc/net/snmp", "Tcp", "InErrs"},
+	{"/proc/net/snmp", "Udp", "RcvbufErrors"},
+};
+
+static const struct counter_name netproto_names[N_NETPROTO_COUNTERS] = {
+	{"retrans", 'r'}, {"listen_drops", 'l'}, {"in_errs", 'e'}, {"rcvbuf_errors", 'u'},
+};
+
+struct netproto_stats {
+	uint64_t counts[N_NETPROTO_COUNTERS];
+};
+
+/* Positions of the fields, snmp fields first */
+struct netproto_state {
+	struct source *snmp, *netstat;
+	struct table_field snmp_fields[N_NETPROTO_COUNTERS];
+	struct table_field netstat_fields[N_NETPROTO_COUNTERS];
+	int snmp_counters[N_NETPROTO_COUNTERS];
+	int netstat_counters[N_NETPROTO_COUNTERS];
+	int n_snmp, n_netstat;
 };
 
 void *
-monitor_create_io_stats_data(const struct cfg *cfg)
+monitor_type_netproto_create_state(const struct cfg *cfg)
 {
-	return malloc(sizeof(struct io_stats));
+	struct netproto_state *state = arena_alloc(cfg->arena, sizeof(struct netproto_state));
+	const struct netproto_field *f;
+	struct table_field *field;
+	int i;
+
+	state->snmp = source_open("/proc/net/snmp");
+	state->netstat = source_open("/proc/net/netstat");
+	for (i = 0; i < N_NETPROTO_COUNTERS; i++) {
+		f = netproto_fields + i;
+		if (!strcmp(f->file, "/proc/net/snmp")) {
+			field = &state->snmp_fields[state->n_snmp];
+			state->snmp_counters[state->n_snmp++] = i;
+			table_field_resolve(source_read(state->snmp, NULL), f->prefix, f->field, field);
+		} else {
+			field = &state->netstat_fields[state->n_netstat];
+			state->netstat_counters[state->n_netstat++] = i;
+			table_field_resolve(source_read(state->netstat, NULL), f->prefix, f->field, field);
+		}
+		if (field->line == -1)
+			warn("netproto: %s %s not found in %s\n", f->prefix, f->field, f->file);
+	}
+	return state;
 }
 
-void 
-monitor_type_iospeed_render(xosd *osd, const struct cfg *cfg,
-		const struct timeval *t_now, const struct timeval *t_before,
-		const void *_io_stats_now, const void *_io_stats_before)
+void
+monitor_type_netproto_retrieve_stats(void *_stats, const struct cfg *cfg)
 {
-	char output[256];
-	const struct io_stats *io_stats_now = _io_stats_now;
-	const struct io_stats *io_stats_before = _io_stats_before;
-	struct io_stats stats_speed;
+	struct netproto_stats *stats = _stats;
+	struct netproto_state *state = cfg->state;
+	uint64_t values[N_NETPROTO_COUNTERS];
+	int i;
 
-	stats_speed.in = speed(io_stats_now->in, io_stats_before->in, t_now, t_before);
-	stats_speed.out = speed(io_stats_now->out, io_stats_before->out, t_now, t_before);
-	format_io_stats(output, sizeof(output), cfg->format, &stats_speed);
-	xosd_set_colour(osd, color_for_level(stats_speed.in + stats_speed.out, cfg));
-	xosd_display(osd, 1, XOSD_string, output);
+	table_fields_read(source_read(state->snmp, NULL), state->snmp_fields, state->n_snmp, values);
+	for (i = 0; i < state->n_snmp; i++)
+		stats->counts[state->snmp_counters[i]] = values[i];
+	table_fields_read(source_read(state->netstat, NULL), state->netstat_fields, state->n_netstat, values);
+	for (i = 0; i < state->n_netstat; i++)
+		stats->counts[state->netstat_counters[i]] = values[i];
 }
 
-/* monitor clock */
-
 void 
-monitor_type_clock_render(xosd *osd, const struct cfg *cfg,
+monitor_type_netproto_render(struct line *line, const struct cfg *cfg,
 		const struct timeval *t_now, const struct timeval *t_before,
 		const void *_stats_now, const void *_stats_before)
 {
-	char output[256];
-	time_t now = time(NULL);
+	const struct netproto_stats *now = _stats_now, *before = _stats_before;
 
-	strftime(output, sizeof(output) - 1, cfg->format, localtime(&now));
-	xosd_display(osd, 1, XOSD_string, output);
+	counter_rates_render(line, cfg, netproto_names, N_NETPROTO_COUNTERS,
+			t_now, t_before, now->counts, before->counts);
 }
 
-/* monitor cpu */
+/* monitor interrupts and softirqs */
 
-struct cpu_stats {
-	float user;
-	float nice;
-	float kernel;
-	float idle;
+#define IRQ_MAX_ENTRIES 256
+#define IRQ_MAX_SHOWN 3
+#define IRQ_ID_SIZE 12
+
+/* Irqs are told apart by what is before the colon, like "24", "LOC" or
+ * "NET_RX", their full names only matter for display */
+struct irq_name {
+	char id[IRQ_ID_SIZE];
+	const char *name;
+};
+
+struct irq_state {
+	struct source *source;
+	int n_cpus;
+	int cpu_column; /* -1 for the sum over all cpus */
+	uint64_t *values;
+	struct irq_name *names;
+	int n_names;
 };
 
+struct irq_stats {
+	int n;
+	struct irq_entry {
+		char id[IRQ_ID_SIZE];
+		uint64_t count;
+	} entries[IRQ_MAX_ENTRIES];
+};
+
+/* Returns the end of the id of the irq line [line, line_end) and sets
+ * [*action, *action + *len) to the name of its (last) action, which numbered
+ * irqs are named after, like "24:eth0-rx-0". NULL for other lines. */
+const char *
+irq_parse_line(const char *line, const char *line_end, const char **action, size_t *len)
+{
+	const char *colon;
+
+	if (!(colon = memchr(line, ':', line_end - line)))
+		return NULL;
+	for (*action = line_end; *action > colon && (*action)[-1] == ' '; (*action)--);
+	*len = *action - colon;
+	for (; *action > colon && (*action)[-1] != ' '; (*action)--);
+	*len -= *action - colon;
+	if (*line < '0' || *line > '9' || (**action >= '0' && **action <= '9'))
+		*len = 0;
+	return colon;
+}
+
+/* device is "interrupts" or "softirqs", optionally followed by "/N" to only
+ * count cpu N */
 void *
-monitor_type_cpu_create_stats_data(const struct cfg *cfg)
+monitor_type_irq_create_state(const struct cfg *cfg)
 {
-	return malloc(sizeof(struct cpu_stats));
+	struct irq_state *state = arena_alloc(cfg->arena, sizeof(struct irq_state));
+	char path[PATH_MAX], cpu_name[32];
+	const char *slash = strchr(cfg->device, '/'), *header, *header_end, *token;
+	const char *line, *line_end, *end, *colon, *action;
+	struct irq_name *name;
+	size_t len;
+	int cpu = slash ? atoi(slash + 1) : -1;
+
+	snprintf(path, sizeof(path), "/proc/%.*s", slash ? (int)(slash - cfg->device) : (int)strlen(cfg->device),
+			cfg->device);
+	state->source = source_open(path);
+	/* the first line names the cpu columns, offline cpus have none */
+	header = source_read(state->source, NULL);
+	header_end = strchrnul(header, '\n');
+	snprintf(cpu_name, sizeof(cpu_name), "CPU%d", cpu);
+	state->cpu_column = -1;
+	while ((token = next_token(&header, header_end, " "))) {
+		if (header - token == strlen(cpu_name) && !strncmp(token, cpu_name, header - token))
+			state->cpu_column = state->n_cpus;
+		state->n_cpus++;
+	}
+	if (cpu >= 0 && state->cpu_column == -1)
+		user_warn("irq: no column for CPU%d in %s, showing all cpus\n", cpu, path);
+	state->values = arena_alloc(cfg->arena, state->n_cpus * sizeof(uint64_t));
+
+	/* irqs that show up later are shown by their id */
+	state->names = arena_alloc(cfg->arena, IRQ_MAX_ENTRIES * sizeof(struct irq_name));
+	end = header + strlen(header);
+	for (line = header_end + 1; line < end && state->n_names < IRQ_MAX_ENTRIES; line = line_end + 1) {
+		line_end = strchrnul(line, '\n');
+		for (; line < line_end && *line == ' '; line++);
+		if (!(colon = irq_parse_line(line, line_end, &action, &len)))
+			continue;
+		name = &state->names[state->n_names++];
+		snprintf(name->id, IRQ_ID_SIZE, "%.*s", (int)(colon - line), line);
+		name->name = arena_alloc(cfg->arena, (colon - line) + len + 2);
+		sprintf((char *)name->name, "%.*s%s%.*s", (int)(colon - line), line,
+				len ? ":" : "", (int)len, action);
+	}
+	return state;
 }
 
 void
-monitor_type_cpu_retrieve_stats(void *_stats, const struct cfg *cfg)
+monitor_type_irq_retrieve_stats(void *_stats, const struct cfg *cfg)
 {
-	struct cpu_stats *stats = _stats;
-	float user, nice, kernel, idle;
-
-	read_columns_from_file("/proc/stat", cfg->device, 4,
-			1, &user, 2, &nice, 3, &kernel, 4, &idle);
-	stats->user = user;
-	stats->nice = nice;
-	stats->kernel = kernel;
-	stats->idle = idle;
+	struct irq_stats *stats = _stats;
+	struct irq_state *state = cfg->state;
+	struct irq_entry *entry;
+	const char *line, *line_end, *end, *colon;
+	size_t len;
+	int n, i;
+
+	line = source_read(state->source, &len);
+	end = line + len;
+	stats->n = 0;
+	for (line = strchrnul(line, '\n') + 1; line < end && stats->n < IRQ_MAX_ENTRIES; line = line_end + 1) {
+		line_end = memchr(line, '\n', end - line);
+		if (!line_end)
+			line_end = end;
+		for (; line < line_end && *line == ' '; line++);
+		if (!(colon = memchr(line, ':', line_end - line)))
+			continue;
+		n = scan_numbers(colon + 1, line_end, state->values, state->n_cpus);
+		if (state->cpu_column >= n)
+			continue;
+		entry = &stats->entries[stats->n++];
+		entry->count = 0;
+		if (state->cpu_column >= 0)
+			entry->count = state->values[state->cpu_column];
+		else
+			for (i = 0; i < n; i++)
+				entry->count += state->values[i];
+		memset(entry->id, 0, IRQ_ID_SIZE);
+		snprintf(entry->id, IRQ_ID_SIZE, "%.*s", (int)(colon - line), line);
+	}
 }
 
-void 
-monitor_type_cpu_render(xosd *osd, const struct cfg *cfg,
-		const struct timeval *t_now, const struct timeval *t_before,
-		const void *_stats_now, const void *_stats_before)
+/* Lines keep their place unless irqs come and go, index is the likely one */
+const char *
+irq_name(const struct irq_state *state, int index, const char *id)
 {
-	char output[256];
-	const struct cpu_stats *stats_now = _stats_now, *stats_before = _stats_before;
-	float user = stats_now->user - stats_before->user;
-	float nice = stats_now->nice - stats_before->nice;
-	float kernel = stats_now->kernel - stats_before->kernel;
-	float idle = stats_now->idle - stats_before->idle;
-	float f = 100.0 * (1.0 - idle/(user + nice + kernel + idle));
+	int i;
 
-	snprintf(output, sizeof(output) - 1, cfg->format, f);
-	xosd_set_colour(osd, color_for_level(f, cfg));
-	xosd_display(osd, 1, XOSD_string, output);
+	if (index < state->n_names && !strcmp(state->names[index].id, id))
+		return state->names[index].name;
+	for (i = 0; i < state->n_names; i++)
+		if (!strcmp(state->names[i].id, id))
+			return state->names[i].name;
+	return id;
 }
 
-/* monitor ctxt */
+struct irq_rate {
+	const char *name;
+	float rate;
+};
 
-void
-monitor_type_ctxt_retrieve_stats(void *_io_stats, const struct cfg *cfg)
+int
+irq_rate_token(char *buf, int size, const char *spec, char conversion, const void *_rate)
 {
-	struct io_stats *io_stats = _io_stats;
-	float ctxt;
+	const struct irq_rate *rate = _rate;
 
-	read_columns_from_file("/proc/stat", "ctxt", 1, 1, &ctxt);
-	io_stats->in = ctxt;
-	io_stats->out = 0;
+	switch (conversion) {
+		case 'n': snprintf(buf, size, "%s", rate->name); break;
+		case 'r': format_number(buf, rate->rate); break;
+		default: return 0;
+	}
+	return 1;
 }
 
-/* monitor running processes */
-
 void 
-monitor_type_runps_render(xosd *osd, const struct cfg *cfg,
+monitor_type_irq_render(struct line *line, const struct cfg *cfg,
 		const struct timeval *t_now, const struct timeval *t_before,
 		const void *_stats_now, const void *_stats_before)
 {
-	char output[256];
-	float running_processes;
-
-	read_columns_from_file("/proc/stat", "procs_running", 1, 1, &running_processes);
-	snprintf(output, sizeof(output) - 1, cfg->format, running_processes);
-	xosd_display(osd, 1, XOSD_string, output);
+	const struct irq_stats *now = _stats_now, *before = _stats_before;
+	const struct irq_state *state = cfg->state;
+	const struct irq_entry *entry;
+	struct irq_rate hottest[IRQ_MAX_SHOWN], rate;
+	char output[256], *o;
+	int n_hottest = 0, i, j;
+
+	for (i = 0; i < now->n; i++) {
+		entry = &now->entries[i];
+		/* entries only move when irqs come and go */
+		j = i < before->n && !strcmp(before->entries[i].id, entry->id) ? i : 0;
+		for (; j < before->n && strcmp(before->entries[j].id, entry->id); j++);
+		if (j == before->n || entry->count < before->entries[j].count)
+			continue;
+		rate.name = irq_name(state, i, entry->id);
+		rate.rate = speed(entry->count - before->entries[j].count, 0, t_now, t_before);
+		for (j = n_hottest; j > 0 && hottest[j - 1].rate < rate.rate; j--)
+			if (j < IRQ_MAX_SHOWN)
+				hottest[j] = hottest[j - 1];
+		if (j < IRQ_MAX_SHOWN)
+			hottest[j] = rate;
+		n_hottest = MIN(n_hottest + 1, IRQ_MAX_SHOWN);
+	}
+	o = output;
+	*o = '\0';
+	for (i = 0; i < n_hottest; i++) {
+		if (i && o < output + sizeof(output) - 2)
+			*o++ = ' ';
+		format_tokens(o, output + sizeof(output) - o, cfg->format, irq_rate_token, &hottest[i]);
+		o += strlen(o);
+	}
+	line_show(line, n_hottest ? color_for_level(hottest[0].rate, cfg) : cfg->color, output);
 }
 
-/* monitor mem */
+/* monitor a single process */
 
-void 
-monitor_type_memory_render(xosd *osd, const struct cfg *cfg,
-		const struct timeval *t_now, const struct timeval *t_before,
-		const void *_stats_now, const void *_stats_before)
+#define PROC_NAME_SIZE 16
+/* How often [s] a process given by name or pid file is looked for while it is
+ * not running, each look reads the comm of every process */
+#define PROC_LOOKUP_INTERVAL 5
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+struct proc_state {
+	const char *device;
+	int level_key;
+	int pid; /* 0 when not running */
+	int pidfd; /* -1 without pidfd_open(2) */
+	struct source *stat, *status, *io;
+	float mem_total;
+	time_t next_lookup; /* while not running */
+};
+
+struct proc_stats {
+	int pid; /* 0 when not running */
+	char name[PROC_NAME_SIZE];
+	uint64_t cpu_ticks; /* user + system */
+	uint64_t read_bytes, written_bytes;
+	struct usage_stats mem; /* free is memory not in the process' RSS */
+};
+
+enum proc_level_key {
+	proc_level_cpu, proc_level_mem, proc_level_io,
+};
+
+static const char *proc_level_keys[] = {"cpu", "mem", "io"};
+
+/* Returns the number after the "name" line of a /proc/<pid>/status like
+ * text, 0 if there is none */
+uint64_t
+proc_field(const char *text, const char *name)
 {
-	char output[256];
-	struct usage_stats usage_stats;
-	float total, free, buffers, cached;
+	const char *line;
+	size_t name_len = strlen(name);
 
-	read_lines_from_file("/proc/meminfo", 4, 
-			"MemTotal:", &total, 
-			"MemFree:", &free, 
-			"Buffers:", &buffers, 
-			"Cached:", &cached);
+	for (line = text; line; line = strchr(line, '\n'), line = line ? line + 1 : NULL)
+		if (!strncmp(line, name, name_len))
+			return strtoull(line + name_len, NULL, 10);
+	return 0;
+}
 
-	/* This is the way htop computes used memory, and it makes sense. 
-	   See http://ubuntuforums.org/showthread.php?t=393176 */
-	usage_stats.free = (free + buffers + cached) * 1024;
-	usage_stats.total = total * 1024;
+/* device is a pid, a pid file (starting with '/') or a process name */
+/* Start time of the process in clock ticks since boot, the 22nd field of its
+ * stat. UINT64_MAX when it is gone, or has exited and waits for its parent
+ * (its pidfd would say it exited right after attaching). */
+uint64_t
+proc_start_time(int pid)
+{
+	char path[PATH_MAX], stat[1024];
+	const char *s, *end, *token;
+	ssize_t len;
+	int fd, i;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC)))
+		return UINT64_MAX;
+	len = read(fd, stat, sizeof(stat) - 1);
+	close(fd);
+	stat[MAX(len, 0)] = '\0';
+	end = stat + strlen(stat);
+	/* comm may contain anything, the fields after it start with the 3rd */
+	if (!(s = strrchr(stat, ')')))
+		return UINT64_MAX;
+	for (s++, i = 3; (token = next_token(&s, end, " ")); i++)
+		if (i == 3 && (*token == 'Z' || *token == 'X'))
+			return UINT64_MAX;
+		else if (i == 22)
+			return strtoull(token, NULL, 10);
+	return UINT64_MAX;
+}
 
-	format_usage_stats(output, sizeof(output), cfg->format, &usage_stats);
-	xosd_set_colour(osd, color_for_level(USED_PERCENTAGE(usage_stats), cfg));
-	xosd_display(osd, 1, XOSD_string, output);
+int
+proc_find_pid(const char *device)
+{
+	char path[PATH_MAX], comm[PROC_NAME_SIZE + 1], entries[8192];
+	struct dirent64 *entry;
+	ssize_t len, n, offset;
+	uint64_t start, found_start = 0;
+	int dir, fd, pid, found = 0;
+
+	if (*device >= '0' && *device <= '9')
+		return atoi(device);
+	if (*device == '/') {
+		if (-1 == (fd = open(device, O_RDONLY | O_CLOEXEC)))
+			return 0;
+		len = read(fd, path, sizeof(path) - 1);
+		close(fd);
+		path[MAX(len, 0)] = '\0';
+		return atoi(path);
+	}
+	/* no opendir, it would allocate every tick the process is away */
+	if (-1 == (dir = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)))
+		return 0;
+	/* the oldest process of that name, usually the parent of the others */
+	while ((n = getdents64(dir, entries, sizeof(entries))) > 0) {
+		for (offset = 0; offset < n; offset += entry->d_reclen) {
+			entry = (struct dirent64 *)(entries + offset);
+			if (!(pid = atoi(entry->d_name)))
+				continue;
+			snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+			if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC)))
+				continue;
+			len = read(fd, comm, sizeof(comm) - 1);
+			close(fd);
+			if (len > 0 && comm[len - 1] == '\n')
+				len--;
+			comm[MAX(len, 0)] = '\0';
+			if (strncmp(comm, device, PROC_NAME_SIZE - 1))
+				continue;
+			/* pids wrap around, only the start time tells the oldest */
+			if ((start = proc_start_time(pid)) == UINT64_MAX)
+				continue;
+			if (!found || start < found_start || (start == found_start && pid < found)) {
+				found = pid;
+				found_start = start;
+			}
+		}
+	}
+	close(dir);
+	return found;
 }
 
-/* monitor swap */
+/* Opens the process' files, returns 0 when it is not running */
+int
+proc_attach(struct proc_state *state)
+{
+	char path[PATH_MAX], c;
+	int pid, err;
+
+	if (!(pid = proc_find_pid(state->device)))
+		return 0;
+	/* the pidfd becomes readable when the process exits, no need to look
+	 * for it every tick */
+	if (-1 == (state->pidfd = syscall(SYS_pidfd_open, pid, 0)) && errno != ENOSYS)
+		return 0;
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if (!(state->stat = source_try_open(path))) {
+		if (state->pidfd != -1)
+			close(state->pidfd);
+		return 0;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	state->status = source_try_open(path);
+	/* io needs the same permissions as ptrace, which are checked on read */
+	snprintf(path, sizeof(path), "/proc/%d/io", pid);
+	if ((state->io = source_try_open(path)) && -1 == pread(state->io->fd, &c, 1, 0)) {
+		err = errno;
+		source_close(state->io);
+		state->io = NULL;
+		errno = err;
+	}
+	if (!state->io)
+		warn("proc: %s: %s, not showing io\n", path, strerror(errno));
+	state->pid = pid;
+	return 1;
+}
 
-void 
-monitor_type_swap_render(xosd *osd, const struct cfg *cfg,
-		const struct timeval *t_now, const struct timeval *t_before,
-		const void *_stats_now, const void *_stats_before)
+void
+proc_detach(struct proc_state *state)
 {
-	char output[256];
-	struct usage_stats usage_stats;
-	float total, free;
+	source_close(state->stat);
+	if (state->status)
+		source_close(state->status);
+	if (state->io)
+		source_close(state->io);
+	if (state->pidfd != -1)
+		close(state->pidfd);
+	state->stat = state->status = state->io = NULL;
+	state->pid = 0;
+}
 
-	read_lines_from_file("/proc/meminfo", 2, 
-			"SwapTotal:", &total, 
-			"SwapFree:", &free);
+int
+proc_exited(const struct proc_state *state)
+{
+	struct pollfd pollfd = {state->pidfd, POLLIN, 0};
 
-	usage_stats.free = free * 1024.0;
-	usage_stats.total = total * 1024.0;
-	format_usage_stats(output, sizeof(output), cfg->format, &usage_stats);
-	xosd_set_colour(osd, color_for_level(USED_PERCENTAGE(usage_stats), cfg));
-	xosd_display(osd, 1, XOSD_string, output);
+	if (state->pidfd == -1)
+		return kill(state->pid, 0) == -1 && errno == ESRCH;
+	return poll(&pollfd, 1, 0) == 1;
 }
 
-/* monitor swapping activity */
+void *
+monitor_type_proc_create_state(const struct cfg *cfg)
+{
+	struct proc_state *state = arena_alloc(cfg->arena, sizeof(struct proc_state));
+	int i;
+
+	state->device = cfg->device;
+	state->level_key = proc_level_cpu;
+	for (i = 0; cfg->level_key && i < sizeof(proc_level_keys)/sizeof(char *); i++)
+		if (!strcmp(cfg->level_key, proc_level_keys[i]))
+			state->level_key = i;
+	if (cfg->level_key && strcmp(cfg->level_key, proc_level_keys[state->level_key]))
+		user_warn("proc: unknown level key %s\n", cfg->level_key);
+	read_lines_from_file("/proc/meminfo", 1, "MemTotal:", &state->mem_total);
+	if (!proc_attach(state)) {
+		warn("proc: %s is not running\n", cfg->device);
+		state->next_lookup = time(NULL) + PROC_LOOKUP_INTERVAL;
+	}
+	return state;
+}
 
 void
-monitor_type_swapact_retrieve_stats(void *_io_stats, const struct cfg *cfg)
+monitor_type_proc_destroy_state(const struct cfg *cfg)
 {
-	struct io_stats *io_stats = _io_stats;
-	float in, out;
+	struct proc_state *state = cfg->state;
 
-	read_lines_from_file("/proc/vmstat", 2, "pswpin", &in, "pswpout", &out);
-	io_stats->in = in * PAGE_SIZE;
-	io_stats->out = out * PAGE_SIZE;
+	if (state->pid)
+		proc_detach(state);
 }
 
-/* monitor disk usage */
+void
+monitor_type_proc_retrieve_stats(void *_stats, const struct cfg *cfg)
+{
+	struct proc_stats *stats = _stats;
+	struct proc_state *state = cfg->state;
+	const char *stat, *s, *end, *token;
+	int i;
+
+	memset(stats, 0, sizeof(struct proc_stats));
+	if (state->pid && proc_exited(state))
+		proc_detach(state);
+	/* a pid given by number can't come back */
+	if (!state->pid && (*state->device < '0' || *state->device > '9') && time(NULL) >= state->next_lookup &&
+			!proc_attach(state))
+		state->next_lookup = time(NULL) + PROC_LOOKUP_INTERVAL;
+	if (!state->pid)
+		return;
+
+	stats->pid = state->pid;
+	/* pid (comm) state ppid ..., comm may contain anything */
+	stat = source_read(state->stat, NULL);
+	end = stat + strlen(stat);
+	if ((s = strchr(stat, '(')) && (token = strrchr(s, ')'))) {
+		snprintf(stats->name, PROC_NAME_SIZE, "%.*s", (int)(token - s - 1), s + 1);
+		s = token + 1;
+		/* utime and stime are the 14th and 15th field */
+		for (i = 3; (token = next_token(&s, end, " ")) && i <= 15; i++)
+			if (i >= 14)
+				stats->cpu_ticks += strtoull(token, NULL, 10);
+	}
+	if (state->status)
+		stats->mem.free = state->mem_total - proc_field(source_read(state->status, NULL), "VmRSS:");
+	else
+		stats->mem.free = state->mem_total;
+	stats->mem.total = state->mem_total;
+	/* both in kB */
+	stats->mem.free *= 1024;
+	stats->mem.total *= 1024;
+	if (state->io) {
+		s = source_read(state->io, NULL);
+		stats->read_bytes = proc_field(s, "read_bytes:");
+		stats->written_bytes = proc_field(s, "write_bytes:");
+	}
+}
+
+struct proc_rates {
+	const struct proc_stats *stats;
+	float cpu;
+	struct io_stats io;
+};
+
+int
+proc_token(char *buf, int size, const char *spec, char conversion, const void *_rates)
+{
+	const struct proc_rates *rates = _rates;
+
+	switch (conversion) {
+		case 'n': snprintf(buf, size, "%s", rates->stats->name); break;
+		case 'p': snprintf(buf, size, "%d", rates->stats->pid); break;
+		case 'c': format_float(buf, size, spec, ".0", rates->cpu); break;
+		case 'i': case 'o': case 't': return io_stats_token(buf, size, spec, conversion, &rates->io);
+		default: return usage_stats_token(buf, size, spec, conversion, &rates->stats->mem);
+	}
+	return 1;
+}
 
 void 
-monitor_type_disk_render(xosd *osd, const struct cfg *cfg,
+monitor_type_proc_render(struct line *line, const struct cfg *cfg,
 		const struct timeval *t_now, const struct timeval *t_before,
 		const void *_stats_now, const void *_stats_before)
 {
-	struct statvfs stat_struct;
+	const struct proc_stats *now = _stats_now, *before = _stats_before;
+	const struct proc_state *state = cfg->state;
+	struct proc_rates rates = {now};
 	char output[256];
-	struct usage_stats usage_stats;
+	float level;
 
-	if (statvfs(cfg->device, &stat_struct)) {
-		user_warn("Unable to statvfs %s: %s\n", cfg->device, strerror(errno));
+	if (!now->pid) {
+		snprintf(output, sizeof(output), "%s: not running", cfg->device);
+		line_show(line, cfg->color, output);
 		return;
 	}
-	usage_stats.total = (float)stat_struct.f_blocks * (float)stat_struct.f_frsize;
-	usage_stats.free = (float)stat_struct.f_bavail * (float)stat_struct.f_bsize;
+	/* no rates across a restart */
+	if (now->pid == before->pid) {
+		rates.cpu = 100.0 * speed(now->cpu_ticks - before->cpu_ticks, 0, t_now, t_before)
+				/ sysconf(_SC_CLK_TCK);
+		rates.io.in = speed(now->read_bytes - before->read_bytes, 0, t_now, t_before);
+		rates.io.out = speed(now->written_bytes - before->written_bytes, 0, t_now, t_before);
+	}
+	format_tokens(output, sizeof(output), cfg->format, proc_token, &rates);
+	switch (state->level_key) {
+		case proc_level_mem: level = USED_PERCENTAGE(now->mem); break;
+		case proc_level_io: level = rates.io.in + rates.io.out; break;
+		default: level = rates.cpu;
+	}
+	line_show(line, color_for_level(level, cfg), output);
+}
 
-	format_usage_stats(output, sizeof(output), cfg->format, &usage_stats);
-	xosd_set_colour(osd, color_for_level(USED_PERCENTAGE(usage_stats), cfg));
-	xosd_display(osd, 1, XOSD_string, output);
+/* monitor temperatures and cpu frequencies */
+
+#define SENSORS_MAX 1024
+
+/* Sensors are found once, their files stay open and are all re-read (with
+ * pread, through the source cache) every tick */
+struct sensors_state {
+	struct source *sources[SENSORS_MAX];
+	int n;
+	float scale;
+	int level_key;
+};
+
+struct sensors_stats {
+	int n;
+	float max;
+	float avg;
+	float min;
+};
+
+static const char *sensors_level_keys[] = {"max", "avg", "min"};
+
+/* device is a comma separated list of globs of sysfs files holding one
+ * number each, which is multiplied by scale */
+void *
+sensors_create_state(const struct cfg *cfg, float scale)
+{
+	struct sensors_state *state = arena_alloc(cfg->arena, sizeof(struct sensors_state));
+	char *patterns = arena_strdup(cfg->arena, cfg->device), *pattern, *saveptr = NULL;
+	struct source *source;
+	glob_t paths;
+	size_t i;
+
+	state->scale = scale;
+	for (i = 0; cfg->level_key && i < sizeof(sensors_level_keys)/sizeof(char *); i++)
+		if (!strcmp(cfg->level_key, sensors_level_keys[i]))
+			state->level_key = i;
+	if (cfg->level_key && strcmp(cfg->level_key, sensors_level_keys[state->level_key]))
+		user_warn("%s: unknown level key %s\n", cfg->monitor->name, cfg->level_key);
+
+	for (pattern = strtok_r(patterns, ",", &saveptr); pattern; pattern = strtok_r(NULL, ",", &saveptr)) {
+		if (glob(pattern, 0, NULL, &paths))
+			continue;
+		for (i = 0; i < paths.gl_pathc && state->n < SENSORS_MAX; i++) {
+			if (!(source = source_try_open(paths.gl_pathv[i])))
+				continue;
+			/* some hwmon sensors are there but can't be read */
+			if (!*source_read(source, NULL)) {
+				source_close(source);
+				continue;
+			}
+			state->sources[state->n++] = source;
+		}
+		globfree(&paths);
+	}
+	if (!state->n)
+		user_warn("%s: no sensors in %s\n", cfg->monitor->name, cfg->device);
+	return state;
 }
 
-/* monitor disk activity */
+void *
+monitor_type_temp_create_state(const struct cfg *cfg)
+{
+	/* millidegrees */
+	return sensors_create_state(cfg, 0.001);
+}
+
+void *
+monitor_type_cpufreq_create_state(const struct cfg *cfg)
+{
+	/* kHz to MHz */
+	return sensors_create_state(cfg, 0.001);
+}
 
 void
-monitor_type_diskact_retrieve_stats(void *_io_stats, const struct cfg *cfg)
+monitor_type_sensors_destroy_state(const struct cfg *cfg)
 {
-	struct io_stats *io_stats = _io_stats;
-	float in, out;
+	struct sensors_state *state = cfg->state;
+	int i;
 
-	read_columns_from_file("/proc/diskstats", cfg->device, 2, 5, &in, 9, &out);
-	io_stats->in = in * SECTOR_SIZE;
-	io_stats->out = out * SECTOR_SIZE;
+	for (i = 0; i < state->n; i++)
+		source_close(state->sources[i]);
 }
 
-/* monitor net */
+void
+monitor_type_sensors_retrieve_stats(void *_stats, const struct cfg *cfg)
+{
+	struct sensors_stats *stats = _stats;
+	struct sensors_state *state = cfg->state;
+	float value, sum = 0;
+	int i;
+
+	stats->n = state->n;
+	for (i = 0; i < state->n; i++) {
+		value = atof(source_read(state->sources[i], NULL)) * state->scale;
+		sum += value;
+		if (!i || value > stats->max)
+			stats->max = value;
+		if (!i || value < stats->min)
+			stats->min = value;
+	}
+	stats->avg = state->n ? sum / state->n : 0;
+}
+
+int
+sensors_stats_token(char *buf, int size, const char *spec, char conversion, const void *_stats)
+{
+	const struct sensors_stats *stats = _stats;
+
+	switch (conversion) {
+		case 'x': format_float(buf, size, spec, ".0", stats->max); break;
+		case 'a': format_float(buf, size, spec, ".0", stats->avg); break;
+		case 'm': format_float(buf, size, spec, ".0", stats->min); break;
+		case 'n': snprintf(buf, size, "%d", stats->n); break;
+		default: return 0;
+	}
+	return 1;
+}
 
 void
-monitor_type_net_retrieve_stats(void *_io_stats, const struct cfg *cfg)
+monitor_type_sensors_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_stats_now, const void *_stats_before)
 {
-	struct io_stats *io_stats = _io_stats;
-	float in, out;
+	const struct sensors_stats *stats = _stats_now;
+	const struct sensors_state *state = cfg->state;
+	const float levels[] = {stats->max, stats->avg, stats->min};
+	char output[256];
 
-	read_columns_from_file("/proc/net/dev", cfg->device, 2, 1, &in, 9, &out);
-	io_stats->in = in;
-	io_stats->out = out;
+	format_tokens(output, sizeof(output), cfg->format, sensors_stats_token, stats);
+	line_show(line, color_for_level(levels[state->level_key], cfg), output);
 }
 
 /* monitor battery */
@@ -644,32 +3387,49 @@ struct battery_stats {
   enum charge_status charge_status;
 };
 
+struct battery_state {
+	struct source *charge_now;
+	struct source *charge_full;
+	struct source *status;
+};
+
+struct source *
+battery_source_open(const char *device, const char *file)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "/sys/class/power_supply/%s/%s", device, file);
+	return source_open(path);
+}
+
 void *
-monitor_type_battery_create_stats_data(const struct cfg *cfg)
+monitor_type_battery_create_state(const struct cfg *cfg)
 {
-	return malloc(sizeof(struct battery_stats));
+	struct battery_state *state = arena_alloc(cfg->arena, sizeof(struct battery_state));
+
+	state->charge_now = battery_source_open(cfg->device, "energy_now");
+	state->charge_full = battery_source_open(cfg->device, "energy_full");
+	state->status = battery_source_open(cfg->device, "status");
+	return state;
 }
 
 void
 monitor_type_battery_retrieve_stats(void *_stats, const struct cfg *cfg)
 {
 	struct battery_stats *stats = _stats;
-  char *line = NULL;
-  size_t len;
-
-	read_first_line_from_file("/sys/class/power_supply/", cfg->device, "/energy_now", &line, &len);
-  stats->charge_now = atol(line);
-	read_first_line_from_file("/sys/class/power_supply/", cfg->device, "/energy_full", &line, &len);
-	stats->charge_full = atol(line);
-	read_first_line_from_file("/sys/class/power_supply/", cfg->device, "/status", &line, &len);
-	stats->charge_status = strcmp(line, "Full") == 0 ? status_full: (
-      strcmp(line, "Charging") == 0 ? status_charging : (
-      strcmp(line, "Discharging") == 0 ? status_discharging : status_unknown));
-  free(line);
+	struct battery_state *state = cfg->state;
+	const char *status;
+
+	stats->charge_now = atol(source_read(state->charge_now, NULL));
+	stats->charge_full = atol(source_read(state->charge_full, NULL));
+	status = source_read(state->status, NULL);
+	stats->charge_status = !strcmp(status, "Full\n") ? status_full : (
+			!strcmp(status, "Charging\n") ? status_charging : (
+			!strcmp(status, "Discharging\n") ? status_discharging : status_unknown));
 }
 
 void 
-monitor_type_battery_render(xosd *osd, const struct cfg *cfg,
+monitor_type_battery_render(struct line *line, const struct cfg *cfg,
 		const struct timeval *t_now, const struct timeval *t_before,
 		const void *_stats_now, const void *_stats_before)
 {
@@ -682,26 +3442,30 @@ monitor_type_battery_render(xosd *osd, const struct cfg *cfg,
     stats->charge_status == status_discharging ? " Discharging" : " ?"));
 
 	snprintf(output, sizeof(output) - 1, cfg->format, f, status);
-	xosd_set_colour(osd, color_for_level(f, cfg));
-	xosd_display(osd, 1, XOSD_string, output);
+	line_show(line, color_for_level(f, cfg), output);
 }
 
-static struct monitor monitors[] = {
+static const struct monitor builtin_monitors[] = {
 	{
 	name:  "clock",
 	description: "Simple clock, strftime(3) format",
 	default_device: NULL,
 	default_format: "%a %b %e %H:%M:%S %G",
+	create_state: monitor_type_clock_create_state,
+	stats_size: 0,
 	create_stats_data:  NULL,
 	retrieve_stats: NULL,
 	render: monitor_type_clock_render,
+	next_tick: monitor_type_clock_next_tick,
 	},
 	{
 	name:  "cpu",
 	description:  "Cpu activity monitor",
 	default_device: "cpu0",
 	default_format: "CPU: %.0f%%",
-	create_stats_data:  monitor_type_cpu_create_stats_data,
+	create_state: monitor_type_cpu_create_state,
+	stats_size: sizeof(struct cpu_stats),
+	create_stats_data:  NULL,
 	retrieve_stats: monitor_type_cpu_retrieve_stats,
 	render: monitor_type_cpu_render,
 	},
@@ -710,7 +3474,8 @@ static struct monitor monitors[] = {
 	description:  "Context switches per second monitor",
 	default_device: NULL,
 	default_format: "ctxt: %i switches/s",
-	create_stats_data:  monitor_create_io_stats_data,
+	stats_size: sizeof(struct io_stats),
+	create_stats_data:  NULL,
 	retrieve_stats: monitor_type_ctxt_retrieve_stats,
 	render: monitor_type_iospeed_render,
 	},
@@ -719,52 +3484,92 @@ static struct monitor monitors[] = {
 	description:  "Processes in the RUNNING state monitor",
 	default_device: NULL,
 	default_format: "procs: %.0f",
+	stats_size: sizeof(float),
 	create_stats_data:  NULL,
-	retrieve_stats: NULL,
+	retrieve_stats: monitor_type_runps_retrieve_stats,
 	render: monitor_type_runps_render,
 	},
 	{
+	name:  "schedstat",
+	description:  "Time tasks waited for a cpu, ms per second, of all cpus and the worst one (from /proc/schedstat)",
+	default_device: NULL,
+	default_format: "runq: %ams/s worst: cpu%c %wms/s",
+	stats_size: sizeof(struct schedstat_stats),
+	create_stats_data:  NULL,
+	retrieve_stats: monitor_type_schedstat_retrieve_stats,
+	render: monitor_type_schedstat_render,
+	},
+	{
 	name:  "mem",
 	description:  "Used memory monitor",
 	default_device: NULL,
 	default_format: "Mem: %U%%, %uB/%tB",
+	stats_size: sizeof(struct usage_stats),
 	create_stats_data:  NULL,
-	retrieve_stats: NULL,
-	render: monitor_type_memory_render,
+	retrieve_stats: monitor_type_memory_retrieve_stats,
+	render: monitor_type_usage_render,
 	},
 	{
 	name:  "swap",
 	description:  "Swap usage monitor",
 	default_device: NULL,
 	default_format: "Swap: %U%%, %uB/%tB",
+	stats_size: sizeof(struct usage_stats),
 	create_stats_data:  NULL,
-	retrieve_stats: NULL,
-	render: monitor_type_swap_render,
+	retrieve_stats: monitor_type_swap_retrieve_stats,
+	render: monitor_type_usage_render,
 	},
 	{
 	name:  "swapact",
 	description:  "Swapping activity monitor",
 	default_device: NULL,
 	default_format: "swapact: %tB (%iB in/%oB out)",
-	create_stats_data:  monitor_create_io_stats_data,
+	create_state: monitor_type_swapact_create_state,
+	stats_size: sizeof(struct io_stats),
+	create_stats_data:  NULL,
 	retrieve_stats: monitor_type_swapact_retrieve_stats,
 	render: monitor_type_iospeed_render,
 	},
 	{
+	name:  "vmstat",
+	description:  "Memory reclaim and paging activity per second: major page faults, direct reclaim scans, kswapd steals, allocation and compaction stalls and OOM kills",
+	default_device: NULL,
+	default_format: "majflt:%f scan:%s stall:%a",
+	create_state: monitor_type_vmstat_create_state,
+	stats_size: sizeof(struct vmstat_stats),
+	create_stats_data:  NULL,
+	retrieve_stats: monitor_type_vmstat_retrieve_stats,
+	render: monitor_type_vmstat_render,
+	},
+	{
 	name:  "disk",
 	description:  "Disk usage monitor. Device is some file on the disk I display usage for!",
 	default_device: "/",
 	default_format: "Disk: %U%%, %uB/%tB",
+	stats_size: sizeof(struct usage_stats),
 	create_stats_data:  NULL,
-	retrieve_stats: NULL,
+	retrieve_stats: monitor_type_disk_retrieve_stats,
 	render: monitor_type_disk_render,
 	},
 	{
+	name:  "disks",
+	description: "Usage of the fullest mount points. Device is a comma separated list of mount point globs and type:fstype globs",
+	default_device: "type:ext[234],type:xfs,type:btrfs",
+	default_format: "%m %U%%",
+	create_state: monitor_type_disks_create_state,
+	stats_size: sizeof(struct disks_stats),
+	create_stats_data:  NULL,
+	retrieve_stats: monitor_type_disks_retrieve_stats,
+	render: monitor_type_disks_render,
+	destroy_state: monitor_type_disks_destroy_state,
+	},
+	{
 	name:  "diskact",
 	description:  "Disk activity monitor",
 	default_device: "hda",
 	default_format: "diskact: %tB (%iB in/%oB out)",
-	create_stats_data:  monitor_create_io_stats_data,
+	stats_size: sizeof(struct io_stats),
+	create_stats_data:  NULL,
 	retrieve_stats: monitor_type_diskact_retrieve_stats,
 	render: monitor_type_iospeed_render,
 	},
@@ -773,22 +3578,405 @@ static struct monitor monitors[] = {
 	description:  "Network activity monitor",
 	default_device: "eth0",
 	default_format: "eth0: %tB (%iB in/%oB out)",
-	create_stats_data:  monitor_create_io_stats_data,
+	stats_size: sizeof(struct io_stats),
+	create_stats_data:  NULL,
 	retrieve_stats: monitor_type_net_retrieve_stats,
 	render: monitor_type_iospeed_render,
 	},
 	{
+	name:  "perf",
+	description:  "Page faults, context switches and cpu migrations per second from perf software events, of all cpus (device all), one cpu (device cpuN) or a cgroup (device is its path)",
+	default_device: "all",
+	default_format: "flt:%f cs:%c migr:%m",
+	create_state: monitor_type_perf_create_state,
+	stats_size: sizeof(struct perf_stats),
+	create_stats_data:  NULL,
+	retrieve_stats: monitor_type_perf_retrieve_stats,
+	render: monitor_type_perf_render,
+	destroy_state: monitor_type_perf_destroy_state,
+	},
+	{
+	name:  "netproto",
+	description:  "TCP/UDP trouble per second (from /proc/net/snmp and /proc/net/netstat)",
+	default_device: NULL,
+	default_format: "retr:%r drop:%l err:%e rcvbuf:%u",
+	create_state: monitor_type_netproto_create_state,
+	stats_size: sizeof(struct netproto_stats),
+	create_stats_data:  NULL,
+	retrieve_stats: monitor_type_netproto_retrieve_stats,
+	render: monitor_type_netproto_render,
+	},
+	{
+	name:  "irq",
+	description:  "Hottest interrupts (device interrupts) or softirqs (device softirqs) per second, all cpus or just cpu N (device interrupts/N)",
+	default_device: "interrupts",
+	default_format: "%n %r",
+	create_state: monitor_type_irq_create_state,
+	stats_size: sizeof(struct irq_stats),
+	create_stats_data:  NULL,
+	retrieve_stats: monitor_type_irq_retrieve_stats,
+	render: monitor_type_irq_render,
+	},
+	{
+	name:  "proc",
+	description: "One process: cpu, memory and io. Device is a pid, a pid file or a process name, followed when it restarts",
+	default_device: "init",
+	default_format: "%n: %c%% %uB %iB/%oB",
+	create_state: monitor_type_proc_create_state,
+	stats_size: sizeof(struct proc_stats),
+	create_stats_data:  NULL,
+	retrieve_stats: monitor_type_proc_retrieve_stats,
+	render: monitor_type_proc_render,
+	destroy_state: monitor_type_proc_destroy_state,
+	},
+	{
+	name:  "temp",
+	description:  "Highest, average and lowest temperature [C] of thermal zones and hwmon sensors. Device is a comma separated list of globs",
+	default_device: "/sys/class/thermal/thermal_zone*/temp,/sys/class/hwmon/hwmon*/temp*_input",
+	default_format: "temp: %xC",
+	create_state: monitor_type_temp_create_state,
+	stats_size: sizeof(struct sensors_stats),
+	create_stats_data:  NULL,
+	retrieve_stats: monitor_type_sensors_retrieve_stats,
+	render: monitor_type_sensors_render,
+	destroy_state: monitor_type_sensors_destroy_state,
+	},
+	{
+	name:  "cpufreq",
+	description:  "Highest, average and lowest cpu frequency [MHz]. Device is a comma separated list of globs",
+	default_device: "/sys/devices/system/cpu/cpu*/cpufreq/scaling_cur_freq",
+	default_format: "freq: %aMHz",
+	create_state: monitor_type_cpufreq_create_state,
+	stats_size: sizeof(struct sensors_stats),
+	create_stats_data:  NULL,
+	retrieve_stats: monitor_type_sensors_retrieve_stats,
+	render: monitor_type_sensors_render,
+	destroy_state: monitor_type_sensors_destroy_state,
+	},
+	{
 	name:  "bat",
 	description:  "Battery capacity (from /sys/class/power_supply/)",
 	default_device: "BAT0",
 	default_format: "bat0: %.0f%%%s",
-	create_stats_data:  monitor_type_battery_create_stats_data,
+	create_state: monitor_type_battery_create_state,
+	stats_size: sizeof(struct battery_stats),
+	create_stats_data:  NULL,
 	retrieve_stats: monitor_type_battery_retrieve_stats,
 	render: monitor_type_battery_render,
 	},
 };
 
-#define N_MONITORS (sizeof(monitors)/sizeof(struct monitor))
+#define N_BUILTIN_MONITORS (sizeof(builtin_monitors)/sizeof(struct monitor))
+
+/* Built in monitors first, then the ones from plugins */
+static const struct monitor *monitors[MAX_MONITORS];
+static int n_monitors = 0;
+
+void
+register_monitor(const struct monitor *monitor)
+{
+	if (n_monitors == MAX_MONITORS) {
+		warn("register_monitor: too many monitors, %s ignored\n", monitor->name);
+		return;
+	}
+	monitors[n_monitors++] = monitor;
+}
+
+/* Plugins ******************************************************************/
+
+void
+load_plugin(const char *path)
+{
+	void *handle;
+	const struct osd_monitors_plugin *plugin;
+	int i;
+
+	if (!(handle = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+		user_warn("Unable to load plugin: %s\n", dlerror());
+		return;
+	}
+	if (!(plugin = dlsym(handle, "osd_monitors_plugin"))) {
+		user_warn("%s is not an osd_monitors plugin\n", path);
+		dlclose(handle);
+		return;
+	}
+	if (plugin->abi_version != OSD_MONITORS_PLUGIN_ABI_VERSION) {
+		user_warn("Plugin %s has ABI version %d, expected %d\n", path,
+				plugin->abi_version, OSD_MONITORS_PLUGIN_ABI_VERSION);
+		dlclose(handle);
+		return;
+	}
+	for (i = 0; i < plugin->n_monitors; i++)
+		register_monitor(plugin->monitors + i);
+}
+
+/* Loads all *.so files in dir. A missing directory is not an error, it's
+ * just no plugins. */
+void
+load_plugins(const char *dir)
+{
+	DIR *d;
+	struct dirent *entry;
+	char path[PATH_MAX];
+	size_t len;
+
+	if (!(d = opendir(dir))) {
+		if (errno != ENOENT)
+			user_warn("Unable to open plugin directory %s: %s\n", dir, strerror(errno));
+		return;
+	}
+	while ((entry = readdir(d))) {
+		len = strlen(entry->d_name);
+		if (len < 3 || strcmp(entry->d_name + len - 3, ".so"))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		load_plugin(path);
+	}
+	closedir(d);
+}
+
+/* Recording ****************************************************************/
+
+/* --record appends the stats data of every tick of every monitor to a file
+ * of fixed size used as a ring buffer. The file is mmap'd, so appending a
+ * record is just a memcpy to the page cache.
+ *
+ * The stats data are taken as 32 bit words. A record holds the differences
+ * from the previous tick of the same monitor, zigzag varint encoded, with
+ * runs of unchanged words collapsed into one varint. Every
+ * RECORD_KEYFRAME_INTERVAL records of a monitor are stored as differences
+ * from zero, so that replay can start even after the beginning of the
+ * history has been overwritten. */
+
+#define RECORD_MAGIC "OSDMREC1"
+#define RECORD_KEYFRAME_INTERVAL 60
+#define RECORD_MAX_SIZE 8192
+#define RECORD_NAME_SIZE 32
+#define RECORD_KEYFRAME 1
+
+struct record_header {
+	char magic[8];
+	uint32_t n_monitors;
+	uint32_t pad;
+	uint64_t n_records;
+	uint64_t size;
+	uint64_t head; /* where the next record goes */
+	uint64_t tail; /* the oldest record */
+	struct {
+		char name[RECORD_NAME_SIZE];
+		uint32_t stats_size;
+		uint32_t pad;
+	} monitors[MAX_LINES];
+};
+
+#define RECORD_DATA_START ((sizeof(struct record_header) + 7) & ~7)
+
+static struct {
+	struct record_header *header; /* the whole file */
+	unsigned long n_records[MAX_LINES];
+} recording;
+
+unsigned char *
+varint_put(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* Returns NULL if the varint does not end before end */
+const unsigned char *
+varint_get(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	for (; p < end && shift < 64; p++, shift += 7) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p & 0x80))
+			return p + 1;
+	}
+	return NULL;
+}
+
+uint64_t
+timeval_ms(const struct timeval *t)
+{
+	return (uint64_t)t->tv_sec * 1000 + t->tv_usec / 1000;
+}
+
+/* before is NULL for a keyframe */
+unsigned char *
+record_encode_words(unsigned char *p, const void *now, const void *before, int n_words)
+{
+	uint32_t word_now, word_before = 0;
+	int32_t diff;
+	uint64_t zeros = 0;
+	int i;
+
+	for (i = 0; i < n_words; i++) {
+		memcpy(&word_now, (const char *)now + 4 * i, 4);
+		if (before)
+			memcpy(&word_before, (const char *)before + 4 * i, 4);
+		diff = word_now - word_before;
+		if (!diff) {
+			zeros++;
+			continue;
+		}
+		if (zeros)
+			p = varint_put(p, zeros << 1 | 1);
+		zeros = 0;
+		p = varint_put(p, (uint64_t)(uint32_t)((diff << 1) ^ (diff >> 31)) << 1);
+	}
+	if (zeros)
+		p = varint_put(p, zeros << 1 | 1);
+	return p;
+}
+
+/* Decodes into now, which holds the previous words (zeros for a keyframe).
+ * Returns NULL on corrupted data. */
+const unsigned char *
+record_decode_words(const unsigned char *p, const unsigned char *end, void *now, int n_words)
+{
+	uint32_t word, zigzag;
+	uint64_t token;
+	int i = 0;
+
+	while (i < n_words) {
+		if (!(p = varint_get(p, end, &token)))
+			return NULL;
+		if (token & 1) {
+			i += token >> 1;
+			continue;
+		}
+		zigzag = token >> 1;
+		memcpy(&word, (char *)now + 4 * i, 4);
+		word += (zigzag >> 1) ^ -(zigzag & 1);
+		memcpy((char *)now + 4 * i, &word, 4);
+		i++;
+	}
+	return i == n_words ? p : NULL;
+}
+
+/* Length of the record at offset (prefix included), 0 for the wrap marker */
+uint64_t
+record_length(const struct record_header *header, uint64_t offset)
+{
+	const unsigned char *p = (const unsigned char *)header + offset;
+	const unsigned char *q;
+	uint64_t len;
+
+	if (offset >= header->size || !*p)
+		return 0;
+	if (!(q = varint_get(p, (const unsigned char *)header + header->size, &len)))
+		return 0;
+	return q - p + len;
+}
+
+/* Drops the oldest records while they lie in [from, to] */
+void
+record_evict(uint64_t from, uint64_t to)
+{
+	struct record_header *header = recording.header;
+
+	uint64_t len;
+
+	while (header->n_records && header->tail >= from && header->tail <= to) {
+		if ((len = record_length(header, header->tail))) {
+			header->tail += len;
+			header->n_records--;
+		} else if (header->tail != RECORD_DATA_START)
+			header->tail = RECORD_DATA_START;
+		else
+			/* corrupt, nothing is left to evict */
+			header->n_records = 0;
+	}
+}
+
+void
+record_open(const char *path, long size, const struct cfg *cfgs, int n_cfgs)
+{
+	struct record_header *header;
+	struct stat st;
+	int fd, i, reuse;
+
+	size = MAX(size, RECORD_DATA_START + 16 * RECORD_MAX_SIZE);
+	if (-1 == (fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) || fstat(fd, &st)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	/* an existing recording of the same monitors is continued */
+	reuse = st.st_size == size;
+	if (!reuse && ftruncate(fd, size)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (header == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	reuse = reuse && !memcmp(header->magic, RECORD_MAGIC, 8) && header->size == size &&
+		header->n_monitors == n_cfgs;
+	for (i = 0; i < n_cfgs && reuse; i++)
+		reuse = !strncmp(header->monitors[i].name, cfgs[i].monitor->name, RECORD_NAME_SIZE) &&
+			header->monitors[i].stats_size == cfgs[i].monitor->stats_size;
+	if (!reuse) {
+		memset(header, 0, RECORD_DATA_START);
+		memcpy(header->magic, RECORD_MAGIC, 8);
+		header->n_monitors = n_cfgs;
+		header->size = size;
+		header->head = header->tail = RECORD_DATA_START;
+		for (i = 0; i < n_cfgs; i++) {
+			strncpy(header->monitors[i].name, cfgs[i].monitor->name, RECORD_NAME_SIZE - 1);
+			header->monitors[i].stats_size = cfgs[i].monitor->stats_size;
+			if (cfgs[i].monitor->stats_size / 4 * 5 + 32 > RECORD_MAX_SIZE) {
+				user_warn("stats of %s are too big to be recorded\n", cfgs[i].monitor->name);
+				header->monitors[i].stats_size = 0;
+			}
+		}
+	}
+	recording.header = header;
+}
+
+/* Appends one tick of the index-th monitor */
+void
+record_append(int index, const struct timeval *t_now, const struct timeval *t_before,
+		const void *stats_now, const void *stats_before)
+{
+	struct record_header *header = recording.header;
+	unsigned char payload[RECORD_MAX_SIZE], prefix[10];
+	unsigned char *p = payload, *dst;
+	int keyframe = recording.n_records[index]++ % RECORD_KEYFRAME_INTERVAL == 0;
+	uint64_t len, prefix_len;
+
+	*p++ = keyframe ? RECORD_KEYFRAME : 0;
+	p = varint_put(p, index);
+	p = varint_put(p, keyframe ? timeval_ms(t_now) : timeval_ms(t_now) - timeval_ms(t_before));
+	p = record_encode_words(p, stats_now, keyframe ? NULL : stats_before,
+			header->monitors[index].stats_size / 4);
+	prefix_len = varint_put(prefix, p - payload) - prefix;
+	len = prefix_len + (p - payload);
+
+	if (header->head + len >= header->size) {
+		record_evict(header->head, header->size);
+		((unsigned char *)header)[header->head] = 0;
+		header->head = RECORD_DATA_START;
+	}
+	record_evict(header->head, header->head + len);
+	dst = (unsigned char *)header + header->head;
+	memcpy(dst, prefix, prefix_len);
+	memcpy(dst + prefix_len, payload, p - payload);
+	if (!header->n_records)
+		header->tail = header->head;
+	header->head += len;
+	header->n_records++;
+}
 
 /* Argument parsing and configuration ***************************************/
 
@@ -803,6 +3991,7 @@ static struct option long_options[] = {
 	{"outline-width", 1, NULL, 'O'},
 	{"outline-color", 1, NULL, 'C'},
 	{"level-colors", 1, NULL, 'L'},
+	{"level-key", 1, NULL, 'K'},
 
 	{"top",      0, NULL, 't'},
 	{"vcenter",  0, NULL, 'v'},
@@ -814,6 +4003,14 @@ static struct option long_options[] = {
 	{"hoffset",  1, NULL, 'H'},
 
 	{"interval", 1, NULL, 'i'},
+	{"plugin-dir", 1, NULL, 'P'},
+	{"multiline", 0, NULL, 'M'},
+	{"config",   1, NULL, 'g'},
+	{"backend",  1, NULL, 'B'},
+	{"record",   1, NULL, 'R'},
+	{"record-size", 1, NULL, 'z'},
+	{"replay",   1, NULL, 'p'},
+	{"replay-speed", 1, NULL, 'x'},
 
 	{"help",     0, NULL, 'h'},
 	{NULL,       0, NULL, 0}
@@ -835,6 +4032,7 @@ static struct option_description
 	{"outline-width", "outline width. (default: 0)"},
 	{"outline-color", "outline color. (default: black)"},
 	{"level-colors", "list of value:color pairs, for monitors where color can change with value"},
+	{"level-key", "which value --level-colors apply to, for monitors showing more values (e.g. steal for cpu)"},
 
 	{"top", "locate at top of screen (default: bottom)"},
 	{"vcenter", "locate in vertical center of screen (default: bottom)"},
@@ -846,6 +4044,14 @@ static struct option_description
 	{"hoffset", "horizontal offset in pixels. (default: 0)"},
 
 	{"interval", "interval (time between updates) in seconds"},
+	{"plugin-dir", "directory to load monitor plugins (*.so) from. (default: " PLUGIN_DIR ")"},
+	{"backend", "how to draw the window: xosd (default) or x11 (native, redraws only changed characters)"},
+	{"record", "append the data of every tick to this ring file"},
+	{"record-size", "size of the --record file in kB. (default: 8192)"},
+	{"replay", "show the data from this --record file instead of the live data, with the same monitor options"},
+	{"replay-speed", "replay this many times faster than recorded, 0 for no delays. (default: 1)"},
+	{"multiline", "show every --type on its own line of one window. Options after a --type apply to that monitor only"},
+	{"config", "read more options and monitors from this file, and apply its changes while running. Implies --multiline"},
 	{"help", "this help message"},
 	{NULL, NULL}
 };
@@ -855,7 +4061,7 @@ void print_usage(const char *progname)
 	struct option *o;
 	struct option_description *od;
 	const char *description;
-	struct monitor *m;
+	const struct monitor *m;
 	int i;
 
 	printf("USAGE: %s [-flag args]\n", progname);
@@ -870,8 +4076,8 @@ void print_usage(const char *progname)
 		printf("%s\n", description);
 	}
 	printf("Available monitors (for the --type option):\n");
-	for (i = 0; i < N_MONITORS; i++) {
-		m = monitors + i;
+	for (i = 0; i < n_monitors; i++) {
+		m = monitors[i];
 		printf("\t%s\t%s.", m->name, m->description);
 		if (m->default_device)
 			printf(" Default device=\"%s\".", m->default_device);
@@ -885,10 +4091,13 @@ void print_usage(const char *progname)
 	}
 }
 
+/* Strings the configuration keeps, like level colors */
+static struct arena config_arena;
+
 void
 parse_level_colors(const char *_level_colors_string, struct cfg *cfg)
 {
-	char *level_colors_string = strdup(_level_colors_string);
+	char *level_colors_string = arena_strdup(&config_arena, _level_colors_string);
 	char *saveptr = NULL, *token;
 
 	token = strtok_r(level_colors_string, " :,;", &saveptr);
@@ -901,25 +4110,209 @@ parse_level_colors(const char *_level_colors_string, struct cfg *cfg)
 		token = strtok_r(NULL, " :,;", &saveptr);
 		if (!token)
 			break;
-		cfg->level_colors[cfg->n_level_colors].color = strdup(token);
+		cfg->level_colors[cfg->n_level_colors].color = token;
 		cfg->n_level_colors++;
 		token = strtok_r(NULL, " :,;", &saveptr);
 	}
-	free(level_colors_string);
 }
 
 
-void 
-parse_options(int argc, char *argv[], struct cfg *cfg)
+/* Options of the window, as opposed to options of one monitor */
+#define WINDOW_OPTIONS "fsoHrmltvbOCB"
+
+void
+apply_option(struct cfg *cfg, char c, char *optarg)
+{
+	switch(c)
+	{
+		case 'D': cfg->device = optarg; break;
+		case 'f': cfg->font = optarg; break;
+		case 'F': cfg->format = optarg; break;
+		case 'c': cfg->color = optarg; break;
+		case 'i': cfg->interval = atoi(optarg); break;
+		case 's': cfg->shadow = atoi(optarg); break;
+		case 'o': cfg->voffset = atoi(optarg); break;
+		case 'H': cfg->hoffset = atoi(optarg); break;
+		case 'r': cfg->hpos = XOSD_right; break;
+		case 'm': cfg->hpos = XOSD_center; break;
+		case 'l': cfg->hpos = XOSD_left; break;
+		case 't': cfg->vpos = XOSD_top; break;
+		case 'v': cfg->vpos = XOSD_middle; break;
+		case 'b': cfg->vpos = XOSD_bottom; break;
+		case 'O': cfg->outline_width = atoi(optarg); break;
+		case 'C': cfg->outline_color = optarg; break;
+		case 'L': parse_level_colors(optarg, cfg); break;
+		case 'B': cfg->backend = optarg; break;
+		case 'K': cfg->level_key = optarg; break;
+	}
+}
+
+void
+set_monitor_type(struct cfg *cfg, const char *type)
+{
+	int i;
+
+	for (i = 0; i < n_monitors; i++) {
+		if (!strcasecmp(type, monitors[i]->name)) {
+			cfg->monitor = monitors[i];
+			cfg->format = monitors[i]->default_format;
+			cfg->device = monitors[i]->default_device;
+			return;
+		}
+	}
+	user_warn("unknown monitor type: %s\n", type);
+}
+
+static const char *record_path = NULL;
+static long record_size = 8192;
+static const char *replay_path = NULL;
+static float replay_speed = 1.0;
+static const char *config_path = NULL;
+
+/* Where parse_option puts things */
+struct parse {
+	struct cfg defaults;
+	struct cfg *cfgs;
+	int n_cfgs;
+	int n_types;
+	int multiline;
+};
+
+/* Applies one option, c is its short name. Without --multiline, there is
+ * just one monitor and the last --type wins. With it, every --type starts a
+ * new monitor. Options before the first --type are defaults for all
+ * monitors, window options apply to all monitors wherever they are. */
+void
+parse_option(struct parse *parse, char c, char *optarg)
+{
+	int i;
+
+	switch(c)
+	{
+		case 'T': if (parse->multiline && parse->n_types) {
+					  if (parse->n_cfgs == MAX_LINES) {
+						  user_warn("too many monitors, %s ignored\n", optarg);
+						  break;
+					  }
+					  memcpy(&parse->cfgs[parse->n_cfgs++], &parse->defaults, sizeof(struct cfg));
+				  }
+				  set_monitor_type(&parse->cfgs[parse->n_cfgs - 1], optarg);
+				  parse->n_types++;
+				  break;
+		case 'P': break; /* already done */
+		case 'M': break; /* already done */
+		case 'g': break; /* read after the other options */
+		case 'R': record_path = optarg; break;
+		case 'z': record_size = atol(optarg); break;
+		case 'p': replay_path = optarg; break;
+		case 'x': replay_speed = atof(optarg); break;
+		default:
+			if (parse->n_types && !strchr(WINDOW_OPTIONS, c)) {
+				apply_option(&parse->cfgs[parse->n_cfgs - 1], c, optarg);
+				break;
+			}
+			apply_option(&parse->defaults, c, optarg);
+			for (i = 0; i < parse->n_cfgs; i++)
+				apply_option(&parse->cfgs[i], c, optarg);
+	}
+}
+
+/* Options that make no sense in a --config file, or can't change on reload */
+#define COMMAND_LINE_OPTIONS "PMgRzpxh"
+
+/* The --config file has a line per option, "name = value" with the long
+ * option name, or just "name" for options without a value. A "[type]" line
+ * starts a new monitor, like --type. '#' starts a comment. The file is kept
+ * in the config arena. Returns 0 when it can't be read. */
+int
+parse_config(struct parse *parse, const char *path)
+{
+	char *text, *line, *line_end, *name, *value, *s;
+	struct option *o;
+	struct stat st;
+	ssize_t len;
+	int fd, line_number;
+
+	if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC)) || fstat(fd, &st)) {
+		perror(path);
+		if (fd != -1)
+			close(fd);
+		return 0;
+	}
+	text = arena_alloc(&config_arena, st.st_size + 1);
+	len = read(fd, text, st.st_size);
+	close(fd);
+	if (len == -1) {
+		perror(path);
+		return 0;
+	}
+	text[len] = '\0';
+
+	for (line = text, line_number = 1; *line; line = line_end, line_number++) {
+		if ((line_end = strchr(line, '\n')))
+			*line_end++ = '\0';
+		else
+			line_end = line + strlen(line);
+		if ((s = strchr(line, '#')))
+			*s = '\0';
+		/* trim */
+		for (; *line == ' ' || *line == '\t'; line++);
+		for (s = line + strlen(line); s > line && strchr(" \t\r", s[-1]); s--);
+		*s = '\0';
+		if (!*line)
+			continue;
+
+		if (*line == '[') {
+			if (s[-1] != ']') {
+				user_warn("%s:%d: missing ]\n", path, line_number);
+				continue;
+			}
+			s[-1] = '\0';
+			parse_option(parse, 'T', line + 1);
+			continue;
+		}
+		name = line;
+		value = NULL;
+		if ((s = strchr(line, '='))) {
+			value = s + 1;
+			for (; s > name && (s[-1] == ' ' || s[-1] == '\t'); s--);
+			*s = '\0';
+			for (; *value == ' ' || *value == '\t'; value++);
+		}
+		for (o = long_options; o->name && strcmp(o->name, name); o++);
+		if (!o->name || strchr(COMMAND_LINE_OPTIONS, o->val)) {
+			user_warn("%s:%d: %s is not a config file option\n", path, line_number, name);
+			continue;
+		}
+		if (o->has_arg && !value) {
+			user_warn("%s:%d: %s needs a value\n", path, line_number, name);
+			continue;
+		}
+		parse_option(parse, o->val, value);
+	}
+	return 1;
+}
+
+/* Fills cfgs from the command line and the --config file, returns their
+ * count, or 0 when the config file can't be read. Strings of cfgs are in
+ * argv or in the config arena. */
+int
+parse_options(int argc, char *argv[], struct cfg *cfgs)
 {
 	char shortops[2 * N_LONG_OPTIONS];
 	struct option *o;
+	struct parse parse;
+	struct cfg *cfg;
 	int i;
 	char c;
 
-	cfg->monitor = monitors;
-	cfg->format = monitors[0].default_format;
-	cfg->device = monitors[0].default_device;
+	static int plugins_loaded = 0;
+	const char *plugin_dir = PLUGIN_DIR;
+
+	cfg = &parse.defaults;
+	cfg->monitor = monitors[0];
+	cfg->format = monitors[0]->default_format;
+	cfg->device = monitors[0]->default_device;
 
 	cfg->font = "";
 	cfg->color = "green";
@@ -930,6 +4323,10 @@ parse_options(int argc, char *argv[], struct cfg *cfg)
 	cfg->shadow = 0;
 	cfg->interval = 1;
 	cfg->n_level_colors = 0;
+	cfg->state = NULL;
+	cfg->backend = "xosd";
+	cfg->level_key = NULL;
+	cfg->arena = NULL;
 	cfg->vpos = XOSD_bottom;
 	cfg->hpos = XOSD_left;
 
@@ -942,113 +4339,490 @@ parse_options(int argc, char *argv[], struct cfg *cfg)
 	}
 	shortops[i] = '\0';
 
+	/* Plugins must be loaded before --type is looked up */
+	parse.multiline = 0;
+	opterr = 0;
+	optind = 0;
+	while ((c = getopt_long(argc ,argv, shortops, long_options, NULL)) != -1) {
+		if (c == 'P')
+			plugin_dir = optarg;
+		if (c == 'M' || c == 'g')
+			parse.multiline = 1;
+		if (c == 'g')
+			config_path = optarg;
+	}
+	if (!plugins_loaded++)
+		load_plugins(plugin_dir);
+	opterr = 1;
+	optind = 0;
+
+	parse.cfgs = cfgs;
+	memcpy(&cfgs[0], &parse.defaults, sizeof(struct cfg));
+	parse.n_cfgs = 1;
+	parse.n_types = 0;
 	while ((c = getopt_long(argc ,argv, shortops, long_options, NULL)) != -1)
 	{
-		switch(c)
-		{
-			case 'T': for (i = 0; i < N_MONITORS; i++) {
-						  if (!strcasecmp(optarg, monitors[i].name)) {
-								  cfg->monitor = monitors + i;
-								  cfg->format = monitors[i].default_format;
-								  cfg->device = monitors[i].default_device;
-								  break;
-							  }
-						  }
-					  if (i == N_MONITORS)
-						  user_warn("unknown monitor type: %s\n", optarg);
-					  break;
-			case 'D': cfg->device = optarg;
-			case 'f': cfg->font = optarg; break;
-			case 'F': cfg->format = optarg; break;
-			case 'c': cfg->color = optarg; break;
-			case 'i': cfg->interval = atoi(optarg); break;
-			case 's': cfg->shadow = atoi(optarg); break;
-			case 'o': cfg->voffset = atoi(optarg); break;
-			case 'H': cfg->hoffset = atoi(optarg); break;
-			case 'r': cfg->hpos = XOSD_right; break;
-			case 'm': cfg->hpos = XOSD_center; break;
-			case 'l': cfg->hpos = XOSD_left; break;
-			case 't': cfg->vpos = XOSD_top; break;
-			case 'v': cfg->vpos = XOSD_middle; break;
-			case 'b': cfg->vpos = XOSD_bottom; break;
-			case 'O': cfg->outline_width = atoi(optarg); break;
-			case 'C': cfg->outline_color = optarg; break;
-			case 'L': parse_level_colors(optarg, cfg); break;
-			case 'h': print_usage(argv[0]); exit(EXIT_SUCCESS);
+		if (c == 'h') {
+			print_usage(argv[0]);
+			exit(EXIT_SUCCESS);
 		}
+		parse_option(&parse, c, optarg);
 	}
+	if (config_path && !parse_config(&parse, config_path))
+		return 0;
+	return parse.n_cfgs;
 };
 
-/* Main *********************************************************************/
+int
+string_equal(const char *a, const char *b)
+{
+	return a == b || (a && b && !strcmp(a, b));
+}
 
-int 
-main(int argc, char *argv[])
+/* Whether two cfgs make the same window */
+int
+window_cfg_equal(const struct cfg *a, const struct cfg *b)
 {
-	struct cfg cfg;
+	return string_equal(a->font, b->font) && string_equal(a->color, b->color) &&
+		string_equal(a->outline_color, b->outline_color) && a->outline_width == b->outline_width &&
+		a->hoffset == b->hoffset && a->voffset == b->voffset && a->vpos == b->vpos &&
+		a->hpos == b->hpos && a->shadow == b->shadow && string_equal(a->backend, b->backend);
+}
 
-	struct timeval t_now, t_before, t_elapsed;
-	void *stats_now = NULL, *stats_before = NULL;
-	struct monitor *monitor;
+/* Whether two cfgs make the same monitor */
+int
+monitor_cfg_equal(const struct cfg *a, const struct cfg *b)
+{
+	int i;
 
-	xosd *osd;
+	if (a->monitor != b->monitor || !string_equal(a->device, b->device) ||
+			!string_equal(a->format, b->format) || !string_equal(a->color, b->color) ||
+			a->interval != b->interval || !string_equal(a->level_key, b->level_key) ||
+			a->n_level_colors != b->n_level_colors)
+		return 0;
+	for (i = 0; i < a->n_level_colors; i++)
+		if (a->level_colors[i].level != b->level_colors[i].level ||
+				!string_equal(a->level_colors[i].color, b->level_colors[i].color))
+			return 0;
+	return 1;
+}
 
-	parse_options(argc, argv, &cfg);
-	monitor = cfg.monitor;
+/* Copies the strings of cfg to arena, so that it does not depend on argv or
+ * the config arena */
+void
+cfg_copy_strings(struct cfg *cfg, struct arena *arena)
+{
+	int i;
 
-	if (!(osd = xosd_create (2))) {
-		fprintf (stderr, "Error initializing osd\n");
-		return EXIT_FAILURE;
-	}
+#define COPY(s) ((s) ? arena_strdup(arena, (s)) : NULL)
+	cfg->device = COPY(cfg->device);
+	cfg->format = COPY(cfg->format);
+	cfg->font = COPY(cfg->font);
+	cfg->color = COPY(cfg->color);
+	cfg->outline_color = COPY(cfg->outline_color);
+	cfg->backend = COPY(cfg->backend);
+	cfg->level_key = COPY(cfg->level_key);
+	for (i = 0; i < cfg->n_level_colors; i++)
+		cfg->level_colors[i].color = COPY(cfg->level_colors[i].color);
+#undef COPY
+}
 
-	if (cfg.font != NULL && strlen(cfg.font) > 0) 
-		xosd_set_font (osd, cfg.font);
-	xosd_set_colour (osd, cfg.color);
-	xosd_set_shadow_offset (osd, cfg.shadow);
-	xosd_set_pos (osd, cfg.vpos);
-	xosd_set_align (osd, cfg.hpos);
-	xosd_set_vertical_offset(osd, cfg.voffset);
-	xosd_set_horizontal_offset(osd, cfg.hoffset);
-	xosd_set_outline_offset(osd, cfg.outline_width);
-	xosd_set_outline_colour(osd, cfg.outline_color);
+/* Main *********************************************************************/
 
-	setup_signal_handlers();
+struct instance {
+	int index;
+	struct cfg cfg;
+	struct arena arena;
+	struct line *line;
+	void *stats_now, *stats_before;
+	struct timeval t_before;
+	struct timeval t_next; /* for monitors with next_tick */
+};
 
-	gettimeofday(&t_before, NULL);
+static struct instance instances[MAX_LINES];
+static int n_instances = 0;
+
+void
+instance_start(struct instance *instance, struct line *line)
+{
+	const struct monitor *monitor = instance->cfg.monitor;
+
+	instance->line = line;
+	line->cfg = &instance->cfg;
+	instance->cfg.arena = &instance->arena;
+	cfg_copy_strings(&instance->cfg, &instance->arena);
+	if (monitor->create_state)
+		instance->cfg.state = monitor->create_state(&instance->cfg);
+
+	gettimeofday(&instance->t_before, NULL);
+	/* show up right away, not at the next boundary */
+	instance->t_next = instance->t_before;
 
 	if (monitor->create_stats_data) {
-		stats_now = monitor->create_stats_data(&cfg);
-		stats_before = monitor->create_stats_data(&cfg);
+		instance->stats_now = monitor->create_stats_data(&instance->cfg);
+		instance->stats_before = monitor->create_stats_data(&instance->cfg);
+	} else if (monitor->stats_size) {
+		instance->stats_now = arena_alloc(&instance->arena, monitor->stats_size);
+		instance->stats_before = arena_alloc(&instance->arena, monitor->stats_size);
 	}
+	if (monitor->retrieve_stats && !replay_path)
+		monitor->retrieve_stats(instance->stats_before, &instance->cfg);
+}
+
+void
+instance_tick(struct instance *instance, const struct timeval *t_now)
+{
+	const struct monitor *monitor = instance->cfg.monitor;
+
 	if (monitor->retrieve_stats)
-		monitor->retrieve_stats(stats_before, &cfg);
+		monitor->retrieve_stats(instance->stats_now, &instance->cfg);
+	if (recording.header)
+		record_append(instance->index, t_now, &instance->t_before,
+				instance->stats_now, instance->stats_before);
+
+	if (visibility && monitor->render)
+		monitor->render(instance->line, &instance->cfg, t_now, &instance->t_before,
+				instance->stats_now, instance->stats_before);
+
+	{ void *swap = instance->stats_now; instance->stats_now = instance->stats_before; instance->stats_before = swap; };
+	memcpy(&instance->t_before, t_now, sizeof(struct timeval));
+	if (monitor->next_tick)
+		monitor->next_tick(&instance->cfg, t_now, &instance->t_next);
+}
 
-	while (1)
-	{
-		usleep(WAKE_INTERVAL * 1000);
-		gettimeofday(&t_now, NULL);
-		timeval_subtract(&t_elapsed, &t_now, &t_before);
-		if (t_elapsed.tv_sec < cfg.interval && !visibility_changed)
+void
+instance_stop(struct instance *instance)
+{
+	if (instance->cfg.monitor->destroy_state)
+		instance->cfg.monitor->destroy_state(&instance->cfg);
+	if (instance->cfg.monitor->create_stats_data) {
+		free(instance->stats_now);
+		free(instance->stats_before);
+	}
+	arena_free(&instance->arena);
+}
+
+/* Sleeps until the first instance with next_tick is due, but at most
+ * WAKE_INTERVAL to look at the others, the visibility and backend events.
+ * Signals end it early. */
+void
+instances_sleep(void)
+{
+	struct timeval t_wake, t_interval = {WAKE_INTERVAL / 1000, WAKE_INTERVAL % 1000 * 1000};
+	struct timespec wake;
+	int i;
+
+	gettimeofday(&t_wake, NULL);
+	timeradd(&t_wake, &t_interval, &t_wake);
+	for (i = 0; i < n_instances; i++)
+		if (instances[i].cfg.monitor->next_tick && timercmp(&instances[i].t_next, &t_wake, <))
+			t_wake = instances[i].t_next;
+	/* an absolute wakeup is not late by the time spent getting here */
+	wake.tv_sec = t_wake.tv_sec;
+	wake.tv_nsec = t_wake.tv_usec * 1000;
+	clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &wake, NULL);
+}
+
+/* What the window was created with, to tell whether a reload changes it */
+static struct cfg window_cfg;
+static struct arena window_arena;
+
+void
+window_start(const struct cfg *cfg, int n_lines)
+{
+	arena_free(&window_arena);
+	memcpy(&window_cfg, cfg, sizeof(struct cfg));
+	cfg_copy_strings(&window_cfg, &window_arena);
+	window_create(&window_cfg, n_lines);
+}
+
+/* The --config file is watched through its directory, editors often replace
+ * the file rather than write it */
+static int config_watch_fd = -1;
+
+void
+config_watch(const char *path)
+{
+	char dir[PATH_MAX];
+	const char *slash = strrchr(path, '/');
+
+	snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) + 1 : 1, slash ? path : ".");
+	if (-1 == (config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) ||
+			-1 == inotify_add_watch(config_watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO))
+		warn("config_watch: %s: %s, changes will not be applied\n", dir, strerror(errno));
+}
+
+/* Whether the --config file was written since the last call */
+int
+config_changed(const char *path)
+{
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	const char *slash = strrchr(path, '/'), *name = slash ? slash + 1 : path;
+	ssize_t len, offset;
+	int changed = 0;
+
+	if (config_watch_fd == -1)
+		return 0;
+	while ((len = read(config_watch_fd, events, sizeof(events))) > 0)
+		for (offset = 0; offset < len; offset += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)(events + offset);
+			if (event->len && !strcmp(event->name, name))
+				changed = 1;
+		}
+	return changed;
+}
+
+/* Applies a changed --config file. Monitors whose options did not change
+ * keep running with their state (and rate baselines), possibly on another
+ * line, the others are stopped or started. The window is only recreated when
+ * its options or number of lines change. */
+void
+reload(int argc, char *argv[])
+{
+	struct cfg cfgs[MAX_LINES];
+	static struct instance old[MAX_LINES];
+	struct line *line;
+	int n_old = n_instances, n, i, j, recreate;
+	int kept[MAX_LINES] = {0}, started[MAX_LINES], changed[MAX_LINES];
+
+	if (recording.header) {
+		user_warn("%s changed, but monitors can't change while recording\n", config_path);
+		return;
+	}
+	if (!(n = parse_options(argc, argv, cfgs))) {
+		user_warn("%s: keeping the old configuration\n", config_path);
+		arena_free(&config_arena);
+		return;
+	}
+	memcpy(old, instances, sizeof(struct instance) * n_old);
+	recreate = n != window.n_lines || !window_cfg_equal(&window_cfg, &cfgs[0]);
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n_old && (kept[j] || !monitor_cfg_equal(&old[j].cfg, &cfgs[i])); j++);
+		started[i] = j == n_old;
+		changed[i] = started[i] || j != i;
+		if (started[i]) {
+			memset(&instances[i], 0, sizeof(struct instance));
+			memcpy(&instances[i].cfg, &cfgs[i], sizeof(struct cfg));
+		} else {
+			kept[j] = 1;
+			memcpy(&instances[i], &old[j], sizeof(struct instance));
+			instances[i].cfg.arena = &instances[i].arena;
+		}
+		instances[i].index = i;
+	}
+	n_instances = n;
+	sources_forget_readers();
+
+	if (recreate) {
+		window_destroy();
+		window_start(&cfgs[0], n);
+	} else {
+		/* forget what other monitors showed before anything is drawn */
+		for (i = 0; i < n; i++)
+			if (changed[i])
+				window.lines[i].color = NULL;
+	}
+	for (i = 0; i < n; i++) {
+		line = &window.lines[i];
+		line->cfg = &instances[i].cfg;
+		instances[i].line = line;
+	}
+	for (j = 0; j < n_old; j++)
+		if (!kept[j])
+			instance_stop(&old[j]);
+	for (i = 0; i < n; i++) {
+		if (!recreate && changed[i])
+			line_clear(&window.lines[i]);
+		if (started[i])
+			instance_start(&instances[i], &window.lines[i]);
+	}
+	arena_free(&config_arena);
+}
+
+/* Feeds the records of a --record file to the monitors, at the recorded pace
+ * divided by speed. */
+void
+replay(const char *path, float speed)
+{
+	const struct record_header *header;
+	const unsigned char *p, *end;
+	struct instance *instance;
+	struct timeval t_now, t_start, t_wall;
+	struct stat st;
+	uint64_t offset, len, index, t, t_first = 0, n;
+	uint64_t t_last[MAX_LINES] = {0};
+	int fd, i, keyframe;
+	long long wait;
+
+	if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC)) || fstat(fd, &st)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (header == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	if (st.st_size < RECORD_DATA_START || memcmp(header->magic, RECORD_MAGIC, 8) ||
+			header->size != st.st_size) {
+		fprintf(stderr, "%s is not a recording\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (header->n_monitors != n_instances) {
+		fprintf(stderr, "%s has %d monitors, %d given\n", path, header->n_monitors, n_instances);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n_instances; i++)
+		if (strncmp(header->monitors[i].name, instances[i].cfg.monitor->name, RECORD_NAME_SIZE) ||
+				header->monitors[i].stats_size > instances[i].cfg.monitor->stats_size) {
+			fprintf(stderr, "monitor %d of %s is %s, not %s\n", i + 1, path,
+					header->monitors[i].name, instances[i].cfg.monitor->name);
+			exit(EXIT_FAILURE);
+		}
+
+	gettimeofday(&t_start, NULL);
+	offset = header->tail;
+	for (n = 0; n < header->n_records;) {
+		len = record_length(header, offset);
+		/* a wrap marker right at the start, or a record past the end, can
+		 * only be a truncated or corrupt file */
+		if ((!len && offset == RECORD_DATA_START) || offset + len > header->size) {
+			fprintf(stderr, "%s is corrupt after %llu of %llu records\n", path,
+					(unsigned long long)n, (unsigned long long)header->n_records);
+			exit(EXIT_FAILURE);
+		}
+		if (!len) {
+			offset = RECORD_DATA_START;
+			continue;
+		}
+		end = (const unsigned char *)header + offset + len;
+		p = varint_get((const unsigned char *)header + offset, end, &index);
+		offset += len;
+		n++;
+		keyframe = *p++ & RECORD_KEYFRAME;
+		if (!(p = varint_get(p, end, &index)) || index >= n_instances || !(p = varint_get(p, end, &t)))
+			continue;
+		instance = &instances[index];
+		/* monitors start at their first keyframe */
+		if (!keyframe && !t_last[index])
 			continue;
+		t += keyframe ? 0 : t_last[index];
+		if (!t_first)
+			t_first = t;
+		t_now.tv_sec = t / 1000;
+		t_now.tv_usec = t % 1000 * 1000;
+
+		if (instance->stats_now) {
+			if (keyframe)
+				memset(instance->stats_now, 0, header->monitors[index].stats_size);
+			else
+				memcpy(instance->stats_now, instance->stats_before, header->monitors[index].stats_size);
+			if (!record_decode_words(p, end, instance->stats_now, header->monitors[index].stats_size / 4)) {
+				warn("replay: corrupted record in %s\n", path);
+				continue;
+			}
+		}
+
+		if (speed > 0) {
+			gettimeofday(&t_wall, NULL);
+			wait = (t - t_first) / speed - ((long long)timeval_ms(&t_wall) - (long long)timeval_ms(&t_start));
+			if (wait > 0)
+				usleep(wait * 1000);
+		}
+		if (window.backend->poll)
+			window.backend->poll();
+		if (visibility_changed && !visibility)
+			window_hide();
 		visibility_changed = 0;
 
-		if (monitor->retrieve_stats)
-			monitor->retrieve_stats(stats_now, &cfg);
+		/* the first record only gives the monitor something to compare with */
+		if (t_last[index] && visibility && instance->cfg.monitor->render)
+			instance->cfg.monitor->render(instance->line, &instance->cfg, &t_now, &instance->t_before,
+					instance->stats_now, instance->stats_before);
+		t_last[index] = t;
+		{ void *swap = instance->stats_now; instance->stats_now = instance->stats_before; instance->stats_before = swap; };
+		memcpy(&instance->t_before, &t_now, sizeof(struct timeval));
+	}
+}
+
+int 
+main(int argc, char *argv[])
+{
+	struct cfg cfgs[MAX_LINES];
+	struct timeval t_now, t_elapsed;
+	uint32_t due_mask, ticked = 0;
+	int i, force, due;
+
+	for (i = 0; i < N_BUILTIN_MONITORS; i++)
+		register_monitor(builtin_monitors + i);
+	if (!(n_instances = parse_options(argc, argv, cfgs)))
+		exit(EXIT_FAILURE);
+
+	window_start(&cfgs[0], n_instances);
 
-		if (visibility) {
-			if (monitor->render)
-				monitor->render(osd, &cfg, &t_now, &t_before, stats_now, stats_before);
-		} else 
-			xosd_display(osd, 1, XOSD_string, "");
+	setup_signal_handlers();
+
+	for (i = 0; i < n_instances; i++) {
+		instances[i].index = i;
+		memcpy(&instances[i].cfg, &cfgs[i], sizeof(struct cfg));
+		instance_start(&instances[i], &window.lines[i]);
+	}
 
-		{ void *swap = stats_now; stats_now = stats_before; stats_before = swap; };
-		memcpy(&t_before, &t_now, sizeof(struct timeval));
+	if (replay_path) {
+		replay(replay_path, replay_speed);
+		return EXIT_SUCCESS;
 	}
+	if (record_path)
+		record_open(record_path, record_size * 1024, cfgs, n_instances);
+	/* the instances have their own copies */
+	arena_free(&config_arena);
+	if (config_path)
+		config_watch(config_path);
 
-	xosd_destroy (osd);
-	if (stats_now)
-		free(stats_now);
-	if (stats_before)
-		free(stats_before);
+	while (1)
+	{
+		if (config_path && config_changed(config_path)) {
+			steady_state = 0;
+			ticked = 0;
+			reload(argc, argv);
+		}
+		instances_sleep();
+		if (window.backend->poll)
+			window.backend->poll();
+		gettimeofday(&t_now, NULL);
+		force = visibility_changed;
+		visibility_changed = 0;
+		if (force && !visibility)
+			window_hide();
+
+		/* which instances tick, so that the sources they read can be
+		 * refreshed together beforehand */
+		due_mask = 0;
+		for (i = 0; i < n_instances; i++) {
+			timeval_subtract(&t_elapsed, &t_now, &instances[i].t_before);
+			if (instances[i].cfg.monitor->next_tick)
+				due = !timercmp(&t_now, &instances[i].t_next, <);
+			else
+				due = t_elapsed.tv_sec >= instances[i].cfg.interval;
+			if (due || force)
+				due_mask |= 1u << i;
+		}
+		if (!due_mask)
+			continue;
+		source_tick++;
+		sources_refresh(due_mask);
+		for (i = 0; i < n_instances; i++)
+			if (due_mask & 1u << i) {
+				source_reader = 1u << i;
+				instance_tick(&instances[i], &t_now);
+			}
+		source_reader = 0;
+		ticked |= due_mask;
+		steady_state = ticked == ~0u >> (32 - n_instances);
+	}
 
 	return EXIT_SUCCESS;
 }
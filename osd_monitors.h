@@ -0,0 +1,215 @@
+/*
+ *  osd_monitors by Tomas Dvorak. https://bitbucket.org/dvtomas/osd-monitors
+ *
+ *  Interface between osd_monitors and its monitors, both the built in ones
+ *  and the ones loaded from plugins.
+ *
+ *  A plugin is a shared object in the plugin directory (see --plugin-dir)
+ *  exporting a `struct osd_monitors_plugin osd_monitors_plugin`. Its monitors
+ *  are then available for the --type option just like the built in ones. The
+ *  plugin is linked against the running osd_monitors, so it can use every
+ *  function declared here. See plugin_example.c.
+ */
+
+#ifndef OSD_MONITORS_H
+#define OSD_MONITORS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <xosd.h>
+
+/* Bumped on every incompatible change of anything in this file. Plugins built
+ * against a different version are refused. */
+#define OSD_MONITORS_PLUGIN_ABI_VERSION 8
+
+/* Prefixed, warn would clash with <err.h> */
+#define osd_warn(format, ...) fprintf (stderr, "WARN: " format, __VA_ARGS__)
+#define osd_user_warn(format, ...) fprintf (stderr, "USER_WARN: " format, __VA_ARGS__)
+
+/* Maximum number of level-color pairs */
+#define MAX_LEVEL_COLORS 100
+
+/* Size of the buffer format_number writes to */
+#define MAX_FORMATTED_NUMBER_SIZE 10
+
+/* Size of the buffer format_tokens passes to a format_token_func */
+#define MAX_FORMATTED_TOKEN_SIZE 32
+
+/* Structures ***************************************************************/
+
+struct level_color {
+	float level;
+	char *color;
+};
+
+struct cfg {
+	const struct monitor *monitor;
+	const char *device;
+	const char *format;
+	char *font;
+	char *color;
+	char *outline_color;
+	int outline_width;
+	int hoffset;
+	int voffset;
+	xosd_pos vpos;
+	xosd_pos hpos;
+	int shadow;
+	int interval;
+	struct level_color level_colors[MAX_LEVEL_COLORS];
+	int n_level_colors;
+	void *state; /* monitor private, see monitor.create_state */
+	const char *backend;
+	const char *level_key; /* NULL for the monitor's default */
+	struct arena *arena; /* for create_state, see arena_alloc */
+};
+
+struct io_stats {
+	float in;
+	float out;
+};
+
+struct usage_stats {
+	float free;
+	float total;
+};
+#define USED_PERCENTAGE(stats) (100.0 * ((stats).total - (stats).free) / (stats).total)
+
+/* One line of the OSD window, a monitor renders to it */
+struct line;
+
+/* Every tick, retrieve_stats fills a stats data buffer (created by
+ * create_stats_data) and render gets it together with the one from the
+ * previous tick, so that it can compute rates. Everything render needs
+ * should come from the stats data, that is what --record saves and
+ * --replay feeds back to render. */
+struct monitor {
+	const char *name;
+	const char *description;
+	const char *default_device;
+	const char *default_format;
+
+	/* Called once at startup, the result is stored in cfg->state. For
+	 * monitors that need to keep something (fds, threads, ...) between
+	 * ticks. */
+	void *(*create_state)(const struct cfg *cfg);
+	/* Size of the stats data. Without create_stats_data, stats data are
+	 * allocated zeroed with this size. create_stats_data must return
+	 * malloc'd memory, it is freed when the monitor is removed. */
+	size_t stats_size;
+	void *(*create_stats_data)(const struct cfg *cfg);
+	void (*retrieve_stats)(void *stats, const struct cfg *cfg);
+	void (*render)(struct line *line, const struct cfg *cfg,
+			const struct timeval *t_now, const struct timeval *t_before,
+			const void *stats_now, const void *stats_before);
+	/* Optional. Sets t_next to when the monitor should tick next, for
+	 * monitors that must tick at given times rather than every
+	 * --interval. */
+	void (*next_tick)(const struct cfg *cfg, const struct timeval *t_now, struct timeval *t_next);
+	/* Optional. Releases what create_state took besides cfg->arena (fds,
+	 * threads, ...), when the monitor is removed by a --config reload. */
+	void (*destroy_state)(const struct cfg *cfg);
+};
+
+struct osd_monitors_plugin {
+	int abi_version; /* always OSD_MONITORS_PLUGIN_ABI_VERSION */
+	const struct monitor *monitors;
+	int n_monitors;
+};
+
+/* Output *******************************************************************/
+
+/* Shows text on the line in color. Nothing is redrawn when neither has
+ * changed since the last call. */
+void line_show(struct line *line, const char *color, const char *text);
+
+/* Source cache *************************************************************/
+
+/* Files under /proc and /sys are opened once and re-read (from offset 0) at
+ * most once per tick, no matter how many monitors use them. */
+struct source;
+
+/* Returns the source for path, opening it on the first use. Exits when the
+ * file can't be opened. The file then stays open for good, so this can be
+ * called every tick. */
+struct source *source_open(const char *path);
+/* Like source_open, but returns NULL (with errno set) when the file can't be
+ * opened, and the source must be released by source_close. For files that
+ * come and go, like the ones of a process. */
+struct source *source_try_open(const char *path);
+/* The file is closed when every source_try_open is released, unless it was
+ * also opened by source_open */
+void source_close(struct source *source);
+/* Returns the contents of the file as of this tick, always '\0' terminated.
+ * len may be NULL. */
+const char *source_read(struct source *source, size_t *len);
+
+/* Arena ********************************************************************/
+
+/* Memory that lives as long as the monitor instance. create_state should
+ * take what it keeps from cfg->arena, so that nothing is allocated once the
+ * monitors run. */
+struct arena;
+
+/* Returns size zeroed bytes, suitably aligned for anything. Exits when out of
+ * memory. */
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *s);
+
+/* Helpers ******************************************************************/
+
+const char *color_for_level(float level, const struct cfg *cfg);
+void format_number(char *buf, float number);
+
+/* Writes the expansion of one %<spec><conversion> to buf, returns 0 for
+ * unknown conversions. See format_tokens. */
+typedef int (*format_token_func)(char *buf, int size, const char *spec, char conversion, const void *data);
+void format_tokens(char *buf, int maxsize, const char *format, format_token_func token, const void *data);
+void format_float(char *buf, int size, const char *spec, const char *default_spec, float value);
+int io_stats_token(char *buf, int size, const char *spec, char conversion, const void *stats);
+int usage_stats_token(char *buf, int size, const char *spec, char conversion, const void *stats);
+void format_io_stats(char *buf, int maxsize, const char *format, struct io_stats *stats);
+void format_usage_stats(char *buf, int maxsize, const char *format, struct usage_stats *stats);
+float speed(float s1, float s2, const struct timeval *t1, const struct timeval *t2);
+void read_columns_from_file(const char *fname, const char *match_pattern, int n_vals, ...);
+void read_lines_from_file(const char *fname, int n_vals, ...);
+
+/* For files made of header/value line pairs, like /proc/net/snmp */
+struct table_field {
+	int line;
+	int column;
+};
+void table_field_resolve(const char *text, const char *prefix, const char *name, struct table_field *field);
+void table_fields_read(const char *text, const struct table_field *fields, int n_fields, uint64_t *values);
+
+/* Reads up to max blank separated unsigned numbers from the start of the line
+ * [p, end), vectorized where the cpu can. Returns how many were read. */
+int scan_numbers(const char *p, const char *end, uint64_t *values, int max);
+
+/* For monitors displaying rates of two counters: retrieve_stats just fills a
+ * struct io_stats, these do the rest. */
+void *monitor_create_io_stats_data(const struct cfg *cfg);
+void monitor_type_iospeed_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *io_stats_now, const void *io_stats_before);
+
+/* For monitors displaying rates of several counters: stats hold an array of
+ * n uint64_t counters, names[i] tells the conversion char for the rate of the
+ * i-th counter, and its name for --level-key. Without --level-key, level
+ * colors apply to the sum of the rates. */
+struct counter_name {
+	const char *name;
+	char conversion;
+};
+void counter_rates_render(struct line *line, const struct cfg *cfg,
+		const struct counter_name *names, int n,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const uint64_t *counts_now, const uint64_t *counts_before);
+
+/* For monitors displaying usage: retrieve_stats fills a struct usage_stats */
+void monitor_type_usage_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *usage_stats_now, const void *usage_stats_before);
+
+#endif
@@ -0,0 +1,69 @@
+/* 
+ *  Example osd_monitors plugin. Build with `make plugin_example.so` and copy
+ *  the result to the plugin directory (see osd_monitors --help), then run
+ *  e.g. `osd_monitors -T filerate -D /var/run/myapp/queue_depth`.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "osd_monitors.h"
+
+/* monitor filerate */
+
+/* The device is a file containing one counter (e.g. items processed by an
+ * application). Displays how fast it grows. */
+
+void
+monitor_type_filerate_retrieve_stats(void *_io_stats, const struct cfg *cfg)
+{
+	struct io_stats *io_stats = _io_stats;
+
+	io_stats->in = atof(source_read(source_open(cfg->device), NULL));
+	io_stats->out = 0;
+}
+
+/* monitor filevalue */
+
+/* The device is a file containing one number (e.g. a queue depth), displayed
+ * as is with a printf format. */
+
+void 
+monitor_type_filevalue_render(struct line *line, const struct cfg *cfg,
+		const struct timeval *t_now, const struct timeval *t_before,
+		const void *_stats_now, const void *_stats_before)
+{
+	char output[256];
+	float value = atof(source_read(source_open(cfg->device), NULL));
+
+	snprintf(output, sizeof(output) - 1, cfg->format, value);
+	line_show(line, color_for_level(value, cfg), output);
+}
+
+static const struct monitor monitors[] = {
+	{
+	name:  "filerate",
+	description:  "Growth rate of a counter in a file",
+	default_device: "/dev/null",
+	default_format: "%i/s",
+	stats_size: sizeof(struct io_stats),
+	create_stats_data:  NULL,
+	retrieve_stats: monitor_type_filerate_retrieve_stats,
+	render: monitor_type_iospeed_render,
+	},
+	{
+	name:  "filevalue",
+	description:  "Number in a file",
+	default_device: "/dev/null",
+	default_format: "%.0f",
+	create_stats_data:  NULL,
+	retrieve_stats: NULL,
+	render: monitor_type_filevalue_render,
+	},
+};
+
+const struct osd_monitors_plugin osd_monitors_plugin = {
+	abi_version: OSD_MONITORS_PLUGIN_ABI_VERSION,
+	monitors: monitors,
+	n_monitors: sizeof(monitors)/sizeof(struct monitor),
+};